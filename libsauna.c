@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <linux/perf_event.h>
+
+#if NVIDIA
+#include <nvml.h>
+#endif
+#if XEONPHI
+#include <miclib.h>
+#endif
+
+#include "libsauna.h"
+
+//#define VERBOSE 1
+
+/* Textual description of the RAPL domains */
+#define NUM_RAPL_DOMAINS	4
+static const char *rapl_domain_names[NUM_RAPL_DOMAINS]= {
+	"cores",
+	"gpu",
+	"pkg",
+	"ram",
+};
+
+/* State of a meter */
+struct sauna {
+   /* Number of channels and their description */
+   int count;
+   struct sauna_channel *channel;
+   /* File descriptors to read the RAPL counters, -1 for devices */
+   int *fd;
+#if NVIDIA
+   /* Flag to know if the NVIDIA API has been initialized */
+   int nvml_up;
+   /* Handle of each channel of a NVIDIA device */
+   nvmlDevice_t *device;
+#endif
+#if XEONPHI
+   /* Handle for the mic device */
+   struct mic_device *mdh;
+#endif
+   /* Energy of devices in nJ, integrated from their power in uW at each
+    * snapshot, and the time of the last one */
+   double *energy;
+   double *power;
+   uint64_t last;
+};
+
+static int perf_event_open(struct perf_event_attr *hw_event_uptr,
+                    pid_t pid, int cpu, int group_fd, unsigned long flags) {
+
+        return syscall(__NR_perf_event_open,hw_event_uptr, pid, cpu,
+                        group_fd, flags);
+}
+
+/* Appends a channel to a meter. Returns NULL when out of memory. */
+static struct sauna_channel *add_channel(struct sauna *meter, int type, int index) {
+   struct sauna_channel *channel;
+   int n = meter->count;
+
+   int *fd;
+#if NVIDIA
+   nvmlDevice_t *device;
+#endif
+
+   /* The arrays are only replaced once grown, so that the meter can still
+    * be closed when out of memory */
+   if((channel = realloc(meter->channel, (n+1)*sizeof(*channel))) == NULL)
+      return NULL;
+   meter->channel = channel;
+   if((fd = realloc(meter->fd, (n+1)*sizeof(*fd))) == NULL)
+      return NULL;
+   meter->fd = fd;
+#if NVIDIA
+   if((device = realloc(meter->device, (n+1)*sizeof(*device))) == NULL)
+      return NULL;
+   meter->device = device;
+#endif
+   meter->count++;
+   meter->fd[n] = -1;
+   channel = &meter->channel[n];
+   memset(channel, 0, sizeof(*channel));
+   channel->type = type;
+   channel->index = index;
+   channel->package = -1;
+   channel->whole = 1;
+   return channel;
+}
+
+/* Package of a cpu, 0 if the topology is not known */
+static int cpu_package(int cpu) {
+   FILE *fff;
+   char filename[BUFSIZ];
+   int package = 0;
+
+   sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",cpu);
+   if((fff=fopen(filename,"r")) != NULL) {
+      if(fscanf(fff,"%d",&package) != 1) package = 0;
+      fclose(fff);
+   }
+   return package;
+}
+
+/* Reads the cpus through which the counters of each package are read,
+ * given as a list of ranges such as 0,18-19. Returns their number, or 0
+ * if the list is not available. */
+static int read_cpumask(int *cpus, int max) {
+   FILE *fff;
+   int first, last, count = 0;
+   char sep;
+
+   if((fff=fopen("/sys/bus/event_source/devices/power/cpumask","r")) == NULL)
+      return 0;
+   while(count < max && fscanf(fff,"%d",&first) == 1) {
+      last = first;
+      sep = '\n';
+      if(fscanf(fff,"%c",&sep) == 1 && sep == '-') {
+         sep = '\n';
+         if(fscanf(fff,"%d%c",&last,&sep) < 1) break;
+      }
+      for(; first <= last && count < max; first++)
+         cpus[count++] = first;
+      if(sep != ',') break;
+   }
+   fclose(fff);
+   return count;
+}
+
+static int init_rapl_perf(struct sauna *meter, const int *cores, int ncores) {
+
+   FILE *fff;
+   int type;
+   int config[NUM_RAPL_DOMAINS];
+   double scale[NUM_RAPL_DOMAINS];
+   char filename[BUFSIZ];
+   char units[BUFSIZ];
+   struct perf_event_attr attr;
+   struct sauna_channel *channel;
+   int *mask = NULL;
+   int i,j,k,core;
+
+   fff=fopen("/sys/bus/event_source/devices/power/type","r");
+   if (fff==NULL) {
+      fprintf(stderr,"No perf_event rapl support found (requires Linux 3.14)\n");
+      return -1;
+   }
+   fscanf(fff,"%d",&type);
+   fclose(fff);
+
+   for(j=0;j<NUM_RAPL_DOMAINS;j++) {
+      config[j]=-1;
+      scale[j]=1;
+
+      sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s",
+            rapl_domain_names[j]);
+
+      fff=fopen(filename,"r");
+
+      if (fff!=NULL) {
+         fscanf(fff,"event=%x",&config[j]);
+#ifdef VERBOSE
+         fprintf(stderr,"Found config=%d\n",config[j]);
+#endif
+         fclose(fff);
+      } else {
+         continue;
+      }
+
+      sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s.scale",
+            rapl_domain_names[j]);
+      fff=fopen(filename,"r");
+
+      if (fff!=NULL) {
+         fscanf(fff,"%lf",&scale[j]);
+#ifdef VERBOSE
+         fprintf(stderr,"Found scale=%g\n",scale[j]);
+#endif
+         fclose(fff);
+      }
+
+      sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s.unit",
+            rapl_domain_names[j]);
+      fff=fopen(filename,"r");
+
+      if (fff!=NULL) {
+         fscanf(fff,"%s",units);
+#ifdef VERBOSE
+         fprintf(stderr,"Found units=%s\n",units);
+#endif
+         fclose(fff);
+      }
+   }
+
+   /* All the cpus of a package read the same counters, so by default only
+    * one of them is opened in each package */
+   if(cores == NULL) {
+      if((mask = malloc(get_nprocs()*sizeof(int))) == NULL) {
+         fprintf(stderr,"Out of memory opening perf events\n");
+         return -1;
+      }
+      if((ncores = read_cpumask(mask, get_nprocs())) == 0)
+         mask[ncores++] = 0;
+      cores = mask;
+   }
+   for(i=0; i<ncores; i++) {
+      core = cores[i];
+      for(j=0;j<NUM_RAPL_DOMAINS;j++) {
+
+#ifdef VERBOSE
+         fprintf(stderr,"Trying core %d with RAPL domain %s (%d)\n",core,rapl_domain_names[j],j);
+#endif
+         if (config[j] == -1) continue;
+
+         if((channel = add_channel(meter, SAUNA_RAPL, core)) == NULL) {
+            fprintf(stderr,"Out of memory opening perf events\n");
+            free(mask);
+            return -1;
+         }
+         snprintf(channel->name, sizeof(channel->name), "core_%d_%s", core, rapl_domain_names[j]);
+         channel->scale = scale[j];
+         channel->package = cpu_package(core);
+         channel->whole = strcmp(rapl_domain_names[j],"cores") != 0 && strcmp(rapl_domain_names[j],"gpu") != 0;
+         /* Only the first channel of each domain in a package adds up */
+         for(k=0; k<meter->count-1 && channel->whole; k++) {
+            if(meter->channel[k].type == SAUNA_RAPL && meter->channel[k].package == channel->package &&
+               strcmp(strrchr(meter->channel[k].name,'_'),strrchr(channel->name,'_')) == 0)
+               channel->whole = 0;
+         }
+
+         memset(&attr, 0, sizeof(attr));
+         attr.type=type;
+         attr.config=config[j];
+
+         meter->fd[meter->count-1]=perf_event_open(&attr,-1,core,-1,PERF_FLAG_FD_CLOEXEC);
+         if (meter->fd[meter->count-1]<0) {
+            if (errno==EACCES) {
+               fprintf(stderr,"Permission denied; run as root or adjust paranoid value\n");
+            }
+            else {
+               fprintf(stderr,"error opening perf events: %s\n",strerror(errno));
+            }
+            free(mask);
+            return -1;
+         }
+      }
+   }
+   free(mask);
+   return 0;
+}
+
+#if NVIDIA
+static int list_nvidia_devices(struct sauna *meter, const int *devices, int ndevices) {
+   int i;
+   unsigned int device_count;
+   nvmlReturn_t result;
+   nvmlDevice_t device;
+   struct sauna_channel *channel;
+   char name[NVML_DEVICE_NAME_BUFFER_SIZE];
+
+   if ((result = nvmlInit()) != NVML_SUCCESS) {
+      fprintf(stderr,"Error: Failed to initialize NVML: %s\n", nvmlErrorString(result));
+      return -1;
+   }
+   meter->nvml_up = 1;
+
+   if ((result = nvmlDeviceGetCount(&device_count)) != NVML_SUCCESS) {
+      fprintf(stderr,"Error: Failed to query device count: %s\n", nvmlErrorString(result));
+      return -1;
+   }
+#ifdef VERBOSE
+   fprintf(stderr,"Found %d NVI device%s\n\n", device_count, device_count != 1 ? "s" : "");
+#endif
+
+   if(devices == NULL) ndevices = device_count;
+   for (i = 0; i < ndevices; i++)
+   {
+       int index = devices == NULL ? i : devices[i];
+
+       if (index < 0 || index >= device_count) {
+          fprintf(stderr,"Error: There is no NVIDIA device %d\n", index);
+          return -1;
+       }
+       // Query for device handle to perform operations on a device
+       // You can also query device handle by other features like:
+       // nvmlDeviceGetHandleBySerial
+       // nvmlDeviceGetHandleByPciBusId
+       if ((result = nvmlDeviceGetHandleByIndex(index, &device)) != NVML_SUCCESS ||
+           (result = nvmlDeviceGetName(device, name, NVML_DEVICE_NAME_BUFFER_SIZE)) != NVML_SUCCESS)
+       {
+          fprintf(stderr,"Error: Failed to list NVIDIA devices: %s\n", nvmlErrorString(result));
+          return -1;
+       }
+
+       if((channel = add_channel(meter, SAUNA_NVML, index)) == NULL) {
+          fprintf(stderr,"Out of memory listing NVIDIA devices\n");
+          return -1;
+       }
+       snprintf(channel->name, sizeof(channel->name), "nvd_%d", index);
+       channel->scale = 1e-9;
+       meter->device[meter->count-1] = device;
+   }
+   return 0;
+}
+
+static int query_nvml_device_power(struct sauna *meter, int n) {
+   nvmlReturn_t result;
+   unsigned int power_usage;
+
+   if ((result = nvmlDeviceGetPowerUsage (meter->device[n], &power_usage)) != NVML_SUCCESS) {
+      if (result == NVML_ERROR_NOT_SUPPORTED) {
+         fprintf(stderr,"\t This is not CUDA capable device\n");
+         power_usage = 0;
+      }
+      else {
+         return -1;
+      }
+   }
+   /* mW to uW */
+   meter->power[n] = power_usage*1e3;
+   return 0;
+}
+#endif
+
+#if XEONPHI
+static void print_mic_error(const char *msg, const char *device_name)
+{
+    const char *mic_err_str = mic_get_error_string();
+
+    fprintf(stderr, "Error");
+    if (device_name != NULL)
+        fprintf(stderr, ": %s", device_name);
+    fprintf(stderr, ": %s", msg);
+    if (strcmp("No error registered", mic_err_str) != 0)
+        fprintf(stderr, ": %s", mic_err_str);
+    if (errno == 0)
+        fprintf(stderr, "\n");
+    else
+        fprintf(stderr, ": %s\n", strerror(errno));
+}
+
+static int init_mic(struct sauna *meter)
+{
+   int ncards, card_num, card;
+   struct mic_devices_list *mdl;
+   struct sauna_channel *channel;
+   int ret;
+   uint32_t device_type;
+
+   ret = mic_get_devices(&mdl);
+   if (ret == E_MIC_DRIVER_NOT_LOADED) {
+      fprintf(stderr, "Error: The driver is not loaded! ");
+      fprintf(stderr, "Load the driver before using this tool.\n");
+      return -1;
+   } else if (ret == E_MIC_ACCESS) {
+      fprintf(stderr, "Error: Access is denied to the driver! ");
+      fprintf(stderr, "Do you have permissions to access the driver?\n");
+      return -1;
+   } else if (ret != E_MIC_SUCCESS) {
+      fprintf(stderr, "Failed to get cards list: %s: %s\n",
+            mic_get_error_string(), strerror(errno));
+      return -1;
+   }
+
+   if (mic_get_ndevices(mdl, &ncards) != E_MIC_SUCCESS) {
+      print_mic_error("Failed to get number of cards", NULL);
+      (void)mic_free_devices(mdl);
+      return -2;
+   }
+
+   if (ncards == 0) {
+      print_mic_error("No MIC card found", NULL);
+      (void)mic_free_devices(mdl);
+      return -3;
+   }
+
+   /* Get card at index 0 */
+   card_num = 0;
+   if (mic_get_device_at_index(mdl, card_num, &card) != E_MIC_SUCCESS) {
+      fprintf(stderr, "Error: Failed to get card at index %d: %s: %s\n",
+            card_num, mic_get_error_string(), strerror(errno));
+      mic_free_devices(mdl);
+      return -4;
+   }
+
+   (void)mic_free_devices(mdl);
+
+   if (mic_open_device(&meter->mdh, card) != E_MIC_SUCCESS) {
+      fprintf(stderr, "Error: Failed to open card %d: %s: %s\n",
+            card_num, mic_get_error_string(), strerror(errno));
+      meter->mdh = NULL;
+      return -5;
+   }
+
+   if (mic_get_device_type(meter->mdh, &device_type) != E_MIC_SUCCESS) {
+      print_mic_error("Failed to get device type", mic_get_device_name(meter->mdh));
+      return -6;
+   }
+
+   if (device_type != KNC_ID) {
+      fprintf(stderr, "Error: Unknown device Type: %u\n", device_type);
+      return -7;
+   }
+   //printf("    Found KNC device '%s'\n", mic_get_device_name(meter->mdh));
+
+   if((channel = add_channel(meter, SAUNA_MIC, card_num)) == NULL) {
+      fprintf(stderr,"Out of memory opening XeonPhi device\n");
+      return -1;
+   }
+   strcpy(channel->name, "mic");
+   channel->scale = 1e-9;
+   return 0;
+}
+
+static int query_mic_device_power(struct sauna *meter, int n) {
+   struct mic_power_util_info *pinfo;
+   uint32_t power_usage;
+
+   /* Power utilization examples */
+   if (mic_get_power_utilization_info(meter->mdh, &pinfo) != E_MIC_SUCCESS) {
+      print_mic_error("Failed to get power utilization information",
+            mic_get_device_name(meter->mdh));
+      return -1;
+   }
+
+   if (mic_get_inst_power_readings(pinfo, &power_usage) != E_MIC_SUCCESS) {
+      print_mic_error("Failed to get instant power readings",
+            mic_get_device_name(meter->mdh));
+      (void)mic_free_power_utilization_info(pinfo);
+      return -1;
+   }
+   meter->power[n] = power_usage;
+
+   (void)mic_free_power_utilization_info(pinfo);
+   return 0;
+}
+#endif
+
+struct sauna *sauna_open(const int *cores, int ncores, const int *devices, int ndevices, int flags) {
+   struct sauna *meter;
+
+   if((meter = calloc(1, sizeof(*meter))) == NULL)
+      return NULL;
+
+   if((flags & SAUNA_RAPL) && init_rapl_perf(meter, cores, ncores) < 0) {
+      sauna_close(meter);
+      return NULL;
+   }
+#if NVIDIA
+   if((flags & SAUNA_NVML) && list_nvidia_devices(meter, devices, ndevices) < 0) {
+      sauna_close(meter);
+      return NULL;
+   }
+#endif
+#if XEONPHI
+   if((flags & SAUNA_MIC) && init_mic(meter) < 0) {
+      sauna_close(meter);
+      return NULL;
+   }
+#endif
+
+   if((meter->energy = calloc(meter->count+1, sizeof(double))) == NULL ||
+      (meter->power = calloc(meter->count+1, sizeof(double))) == NULL) {
+      sauna_close(meter);
+      return NULL;
+   }
+   return meter;
+}
+
+void sauna_close(struct sauna *meter) {
+   int i;
+#if NVIDIA
+   nvmlReturn_t result;
+   if(meter->nvml_up) {
+      if ((result = nvmlShutdown()) != NVML_SUCCESS) {
+         fprintf(stderr,"Failed to shutdown NVML: %s\n", nvmlErrorString(result));
+      }
+   }
+   free(meter->device);
+#endif
+#if XEONPHI
+   if(meter->mdh != NULL)
+      (void)mic_close_device(meter->mdh);
+#endif
+   for(i=0; i<meter->count; i++) {
+      if (meter->fd[i]!=-1) {
+         close(meter->fd[i]);
+      }
+   }
+   free(meter->fd);
+   free(meter->channel);
+   free(meter->energy);
+   free(meter->power);
+   free(meter);
+}
+
+int sauna_channel_count(const struct sauna *meter) {
+   return meter->count;
+}
+
+const struct sauna_channel *sauna_channels(const struct sauna *meter) {
+   return meter->channel;
+}
+
+struct sauna_snapshot *sauna_snapshot_new(const struct sauna *meter) {
+   return calloc(1, sizeof(struct sauna_snapshot)+meter->count*sizeof(long long));
+}
+
+struct sauna_energy *sauna_energy_new(const struct sauna *meter) {
+   return calloc(1, sizeof(struct sauna_energy)+meter->count*sizeof(double));
+}
+
+void sauna_snapshot_copy(const struct sauna *meter, struct sauna_snapshot *dst, const struct sauna_snapshot *src) {
+   memcpy(dst, src, sizeof(struct sauna_snapshot)+meter->count*sizeof(long long));
+}
+
+int sauna_snapshot(struct sauna *meter, struct sauna_snapshot *snapshot) {
+   struct timespec now;
+   double power, elapsed;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   snapshot->time = (uint64_t)now.tv_sec*1000000000+now.tv_nsec;
+   elapsed = meter->last ? (double)(snapshot->time-meter->last) : 0;
+   meter->last = snapshot->time;
+
+   for(i=0; i<meter->count; i++) {
+      switch(meter->channel[i].type) {
+         case SAUNA_RAPL:
+            if(read(meter->fd[i],&snapshot->value[i],8) != 8)
+               return -1;
+            continue;
+#if NVIDIA
+         case SAUNA_NVML:
+            power = meter->power[i];
+            if(query_nvml_device_power(meter, i) < 0)
+               return -1;
+            break;
+#endif
+#if XEONPHI
+         case SAUNA_MIC:
+            power = meter->power[i];
+            if(query_mic_device_power(meter, i) < 0)
+               return -1;
+            break;
+#endif
+         default:
+            continue;
+      }
+      /* Trapezoidal rule, uW by ns to nJ */
+      if(elapsed == 0) power = meter->power[i];
+      meter->energy[i] += (power+meter->power[i])/2*elapsed*1e-6;
+      snapshot->value[i] = meter->energy[i];
+   }
+   return 0;
+}
+
+void sauna_diff(const struct sauna *meter, const struct sauna_snapshot *before,
+      const struct sauna_snapshot *after, struct sauna_energy *energy) {
+   int i;
+
+   energy->time = after->time-before->time;
+   energy->total = 0;
+   for(i=0; i<meter->count; i++) {
+      energy->channel[i] = (double)(after->value[i]-before->value[i])*meter->channel[i].scale;
+      if(meter->channel[i].whole)
+         energy->total += energy->channel[i];
+   }
+}
@@ -0,0 +1,105 @@
+#ifndef LIBSAUNA_H
+#define LIBSAUNA_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Library to read the energy counters of CPUs, NVIDIA GPUs and XeonPhi
+ * from within a program. A meter is opened on a set of cores and devices,
+ * snapshots of all its channels are taken at any time, and the energy
+ * consumed between two snapshots is obtained with sauna_diff. A meter
+ * keeps no global state, so several of them can be used at once.
+ *
+ *    struct sauna *meter = sauna_open(NULL, 0, NULL, 0, SAUNA_RAPL);
+ *    struct sauna_snapshot *before = sauna_snapshot_new(meter);
+ *    struct sauna_snapshot *after = sauna_snapshot_new(meter);
+ *    struct sauna_energy *energy = sauna_energy_new(meter);
+ *
+ *    sauna_snapshot(meter, before);
+ *    work();
+ *    sauna_snapshot(meter, after);
+ *    sauna_diff(meter, before, after, energy);
+ *    printf("%f J in %f s\n", energy->total, energy->time*1e-9);
+ *
+ * The header can be included from C++, although the flexible array members
+ * of sauna_snapshot and sauna_energy are a GNU extension there, accepted
+ * by g++ and clang++.
+ */
+
+/* Kinds of channels, also used as flags to select them in sauna_open */
+#define SAUNA_RAPL	1
+#define SAUNA_NVML	2
+#define SAUNA_MIC	4
+
+/* Description of a channel of a meter */
+struct sauna_channel {
+   /* Name used in the headers of sauna: core_<n>_<domain>, nvd_<n> or mic */
+   char name[32];
+   /* One of SAUNA_RAPL, SAUNA_NVML or SAUNA_MIC */
+   int type;
+   /* Core or device the channel belongs to */
+   int index;
+   /* Package of the core, -1 for devices */
+   int package;
+   /* Flag to know if the channel adds up to the total energy. RAPL cores
+    * and gpu domains do not, as they are already included in pkg, and the
+    * pkg and ram domains only do for the first core of each package, as
+    * all its cores read the same counters. */
+   int whole;
+   /* Joules per unit of the counter */
+   double scale;
+};
+
+/* Value of all the channels of a meter at an instant */
+struct sauna_snapshot {
+   /* CLOCK_MONOTONIC time in ns */
+   uint64_t time;
+   /* Energy counter of each channel, in units of its scale */
+   long long value[];
+};
+
+/* Energy consumed between two snapshots */
+struct sauna_energy {
+   /* Time between the snapshots in ns */
+   uint64_t time;
+   /* Joules of the whole channels */
+   double total;
+   /* Joules of each channel */
+   double channel[];
+};
+
+/* Opens a meter on the RAPL counters of the given cores and on the given
+ * NVIDIA devices. When the list of cores is NULL, one core of each package
+ * is used, and when the list of devices is NULL, all of them. flags
+ * selects the kinds of channels. Returns NULL on error. */
+struct sauna *sauna_open(const int *cores, int ncores, const int *devices, int ndevices, int flags);
+void sauna_close(struct sauna *meter);
+
+int sauna_channel_count(const struct sauna *meter);
+const struct sauna_channel *sauna_channels(const struct sauna *meter);
+
+/* Allocate snapshots and energies for the channels of a meter. They are
+ * released with free. */
+struct sauna_snapshot *sauna_snapshot_new(const struct sauna *meter);
+struct sauna_energy *sauna_energy_new(const struct sauna *meter);
+void sauna_snapshot_copy(const struct sauna *meter, struct sauna_snapshot *dst, const struct sauna_snapshot *src);
+
+/* Reads all the channels of a meter. RAPL counters take a few us each.
+ * NVIDIA and XeonPhi devices only give power, which is integrated into
+ * their counters at every snapshot, so their accuracy depends on how often
+ * snapshots are taken, and reading them takes much longer. Returns -1 on
+ * error. */
+int sauna_snapshot(struct sauna *meter, struct sauna_snapshot *snapshot);
+
+/* Computes the energy consumed between two snapshots */
+void sauna_diff(const struct sauna *meter, const struct sauna_snapshot *before,
+      const struct sauna_snapshot *after, struct sauna_energy *energy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Companion tool of sauna to inspect large traces. The trace is memory
+ * mapped and the time of every sample of a job is kept in an index, saved
+ * next to the trace and mapped as well, so any window is found with a
+ * binary search without loading the index. Samples are processed in
+ * blocks stored by column, and the reductions over each column are marked
+ * with omp simd so that the compiler can vectorise them, reordering their
+ * sums. */
+
+/* Global variables */
+
+/* BEGIN CONFGURATION */
+#define VERSION "1.4"
+/* Number of samples processed at once */
+#define BLOCK	1024
+/* Maximum number of columns of a trace */
+#define MAX_COLUMNS	1100
+/* END CONFGURATION */
+
+#define INDEX_MAGIC	"SAUNAID2"
+
+/* A sample of the index: its time, made monotonic across measurements
+ * that restart the clock of sauna, and the offset of its line */
+struct entry {
+   double time;
+   uint64_t offset;
+};
+
+/* Header of the index file. It is only valid for a trace with the same
+ * size and modification time, and for the same job. */
+struct index_header {
+   char magic[8];
+   uint64_t size;
+   int64_t mtime, mtime_nsec;
+   int32_t node, job;
+   uint64_t header;
+   uint64_t count;
+};
+
+/* Trace mapped in memory */
+const char *trace;
+size_t trace_size;
+/* Number of job numbers that precede every line, and the job selected */
+int prefix_count = 0;
+int node = -1, job = -1;
+/* Names of the columns, from the header of the job */
+char *columns[MAX_COLUMNS];
+int column_count = 0;
+/* Index of the samples of the job, mapped from its file */
+void *index_map;
+size_t index_size;
+struct entry *entries;
+size_t entry_count = 0;
+/* Samples of a block, stored by column, and the time each one covers */
+double block_time[BLOCK];
+double block_dt[BLOCK];
+double *block_value;
+
+/* Functions */
+void usage(int argc, char **argv);
+void help(int argc, char **argv);
+const char *line_end(const char *line);
+const char *skip_prefix(const char *line, const char *end, int *prefix);
+int find_header(struct index_header *header);
+int map_index(int fd, struct index_header *header);
+int load_index(const char *filename, struct index_header *header);
+int build_index(const char *filename, struct index_header *header);
+size_t find_time(double time);
+int parse_row(size_t n, int row);
+size_t read_block(size_t first, size_t last, double start, double end);
+void print_rows(size_t first, size_t last);
+void downsample(size_t first, size_t last, double start, double end, int points, double *energy);
+void lttb(size_t first, size_t last, int points, int column);
+void integrate(size_t first, size_t last, double start, double end, double *energy);
+
+int main(int argc, char **argv)
+{
+   int i, c = 0, fd;
+   struct stat st;
+   struct index_header header;
+   char *filename, *endp, *index_name;
+   /* Window, resolution and column of the LTTB */
+   double start = -INFINITY, end = INFINITY;
+   int points = 0, column = -1;
+   char *column_name = NULL;
+   /* Flag to output the energy of the window */
+   int flag_energy = 0;
+   double energy[MAX_COLUMNS];
+   size_t first, last, stop, page;
+
+   /* Disable getopt error reporting */
+   opterr = 0;
+   while ((c = getopt (argc, argv, "j::n::w::r::l::e::h::v::")) != -1)
+
+      switch (c) {
+         case 'j':
+            if (!optarg || (job = strtol(optarg, &endp, 10)) < 0 || *endp) {
+               fprintf(stderr,"Invalid job %s.\n", optarg?optarg:"(null)");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'n':
+            if (!optarg || (node = strtol(optarg, &endp, 10)) < 0 || *endp) {
+               fprintf(stderr,"Invalid node %s.\n", optarg?optarg:"(null)");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'w':
+            if (!optarg || (start = strtod(optarg, &endp), *endp != ',') ||
+                (end = strtod(endp+1, &endp), *endp) || end < start) {
+               fprintf(stderr,"Invalid window %s - expecting <start>,<end> in seconds.\n", optarg?optarg:"(null)");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'r':
+            if (!optarg || (points = strtol(optarg, &endp, 10)) < 3 || *endp) {
+               fprintf(stderr,"Invalid resolution %s - expecting at least 3 points.\n", optarg?optarg:"(null)");
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'l':
+            if (!optarg) {
+               fprintf(stderr,"Missing column for LTTB.\n");
+               return EXIT_FAILURE;
+            }
+            column_name = optarg;
+            break;
+         case 'e':
+            flag_energy = 1;
+            break;
+         case 'v':
+            fprintf(stderr,"sauna-trace %s\n",VERSION);
+            return 0;
+         case 'h':
+            help(argc, argv);
+            return 0;
+         case '?':
+            if (isprint (optopt))
+               printf ("Error: Unknown option `-%c'.\n", optopt);
+            else
+               printf ("Error: Unknown option character `\\x%x'.\n", optopt);
+         default:
+            usage(argc, argv);
+            return 0;
+      }
+
+   if(optind != argc-1) {
+      printf ("Error: Expecting a single trace.\n");
+      usage(argc, argv);
+      return 0;
+   }
+   filename = argv[optind];
+   if(column_name != NULL && points == 0) {
+      fprintf(stderr,"LTTB needs a resolution given with -r.\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Map the trace in memory */
+   if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr,"Could not open trace %s. %s\n", filename, strerror(errno));
+      return EXIT_FAILURE;
+   }
+   trace_size = st.st_size;
+   if(trace_size == 0 || (trace = mmap(NULL, trace_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+      fprintf(stderr,"Could not map trace %s. %s\n", filename, trace_size ? strerror(errno) : "Empty file");
+      return EXIT_FAILURE;
+   }
+   close(fd);
+
+   /* Find the header of the job, and its index */
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+   header.size = st.st_size;
+   header.mtime = st.st_mtim.tv_sec;
+   header.mtime_nsec = st.st_mtim.tv_nsec;
+   if(find_header(&header) < 0) {
+      fprintf(stderr,"No header found in trace %s.\n", filename);
+      return EXIT_FAILURE;
+   }
+   if(asprintf(&index_name, "%s.idx", filename) < 0)
+      return EXIT_FAILURE;
+   if(load_index(index_name, &header) < 0 && build_index(index_name, &header) < 0)
+      return EXIT_FAILURE;
+   free(index_name);
+   /* Windows are read from anywhere in the trace */
+   madvise((void *)trace, trace_size, MADV_RANDOM);
+
+   if(column_name != NULL) {
+      for(column = 0; column < column_count && strcmp(columns[column], column_name) != 0; column++);
+      if(column == column_count) {
+         fprintf(stderr,"There is no column %s in the trace.\n", column_name);
+         return EXIT_FAILURE;
+      }
+   }
+   if((block_value = malloc((column_count+1)*BLOCK*sizeof(double))) == NULL) {
+      fprintf(stderr,"Error: out of memory.\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Samples in the window, which can not go beyond the trace. The sample
+    * after the end also covers part of the window. */
+   first = find_time(start);
+   last = find_time(end);
+   if(start < 0) start = 0;
+   if(last == entry_count && end > (last > 0 ? entries[last-1].time : 0))
+      end = last > 0 ? entries[last-1].time : 0;
+   if(start > end) start = end;
+   stop = last < entry_count ? last+1 : last;
+
+   /* Read ahead the lines of the window */
+   if(first < stop) {
+      page = entries[first].offset & ~(size_t)(sysconf(_SC_PAGESIZE)-1);
+      madvise((void *)(trace+page), entries[stop-1].offset+1-page, MADV_WILLNEED);
+   }
+
+   if(column >= 0)
+      lttb(first, last, points, column);
+   else if(points > 0)
+      downsample(first, stop, start, end, points, energy);
+   else
+      print_rows(first, last);
+
+   if(flag_energy) {
+      if(column >= 0 || points == 0)
+         integrate(first, stop, start, end, energy);
+      fprintf(stdout,"Energy: %f",end-start);
+      for(i = 0; i < column_count; i++)
+         fprintf(stdout," %f",energy[i]);
+      fprintf(stdout,"\n");
+   }
+
+   munmap(index_map, index_size);
+   munmap((void *)trace, trace_size);
+   return 0;
+}
+
+void usage(int argc, char **argv) {
+      printf ("Usage: %s [-evh] [-j<job>] [-n<node>] [-w<start>,<end>] [-r<points>] [-l<column>] <trace>\n", argv[0]);
+}
+
+void help(int argc, char **argv) {
+      usage(argc,argv);
+      printf (
+            "\n"
+            "This program extracts windows of a trace written by sauna, and reduces them to a\n"
+            "number of points that can be plotted. The time of every sample is kept in an index\n"
+            "in <trace>.idx, so that later uses do not need to scan the trace again.\n"
+            "\n"
+            "   -j Selects the job of a trace with several. Default the first one.\n"
+            "\n"
+            "   -n Selects the node of a trace merged by the collector. Default the first one.\n"
+            "\n"
+            "   -w Restricts the output to the samples from <start> to <end> seconds. Successive\n"
+            "      measurements of the same job, as several ROIs, are placed one after another.\n"
+            "\n"
+            "   -r Reduces the window to the given number of intervals of the same length, where\n"
+            "      each column is replaced by its minimum, mean and maximum power.\n"
+            "\n"
+            "   -l Reduces the window to the number of points given with -r of a single column,\n"
+            "      chosen with the Largest Triangle Three Buckets algorithm.\n"
+            "\n"
+            "   -e Writes the energy of each column in the window, integrated from the samples.\n"
+            "\n"
+            "   -v Show version number.\n"
+            "\n"
+            "   -h Displays this message.\n"
+            "\n"
+            );
+}
+
+/* Returns the end of a line, at its newline or at the end of the trace */
+const char *line_end(const char *line) {
+   const char *end = memchr(line, '\n', trace+trace_size-line);
+   return end ? end : trace+trace_size;
+}
+
+/* Skips the job numbers at the beginning of a line, storing them in
+ * prefix. Returns NULL if the line does not start with them. */
+const char *skip_prefix(const char *line, const char *end, int *prefix) {
+   int i;
+
+   for(i = 0; i < prefix_count; i++) {
+      prefix[i] = 0;
+      if(line == end || !isdigit(*line)) return NULL;
+      while(line < end && isdigit(*line))
+         prefix[i] = prefix[i]*10 + *line++ - '0';
+      if(line == end || *line != ' ') return NULL;
+      line++;
+   }
+   return line;
+}
+
+/* Checks if a line belongs to the job selected */
+static int selected(const int *prefix) {
+   if(prefix_count == 0) return 1;
+   if(prefix[prefix_count-1] != job) return 0;
+   return prefix_count < 2 || prefix[0] == node;
+}
+
+/* Finds the header of the job selected, which gives the number of job
+ * numbers that precede each line and the names of the columns. */
+int find_header(struct index_header *header) {
+   const char *line, *end, *it;
+   int prefix[2];
+   char *names;
+
+   for(line = trace; line < trace+trace_size; line = end+1) {
+      end = line_end(line);
+      /* Count the numbers before "time" */
+      for(it = line, prefix_count = 0; prefix_count < 3 && it < end && isdigit(*it); prefix_count++) {
+         while(it < end && isdigit(*it)) it++;
+         if(it < end && *it == ' ') it++;
+      }
+      if(prefix_count > 2 || end-it < 4 || strncmp(it, "time", 4) != 0 || (end-it > 4 && it[4] != ' '))
+         continue;
+      skip_prefix(line, end, prefix);
+      if(job < 0 && prefix_count > 0) job = prefix[prefix_count-1];
+      if(node < 0 && prefix_count > 1) node = prefix[0];
+      if(!selected(prefix)) continue;
+
+      header->node = node;
+      header->job = job;
+      header->header = line-trace;
+      if((names = strndup(it+4, end-it-4)) == NULL)
+         return -1;
+      for(it = strtok(names, " "); it != NULL && column_count < MAX_COLUMNS; it = strtok(NULL, " "))
+         columns[column_count++] = (char *)it;
+      return 0;
+   }
+   return -1;
+}
+
+/* Maps an index, checking that it belongs to the trace and the job */
+int map_index(int fd, struct index_header *header) {
+   struct index_header *saved;
+   struct stat st;
+   void *map;
+
+   if(fstat(fd, &st) < 0 || st.st_size < sizeof(*saved) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      return -1;
+   saved = map;
+   if(memcmp(saved, header, offsetof(struct index_header, count)) != 0 ||
+      st.st_size != sizeof(*saved)+saved->count*sizeof(struct entry)) {
+      munmap(map, st.st_size);
+      return -1;
+   }
+   index_map = map;
+   index_size = st.st_size;
+   entries = (struct entry *)(saved+1);
+   entry_count = header->count = saved->count;
+   return 0;
+}
+
+int load_index(const char *filename, struct index_header *header) {
+   int fd, ret;
+
+   if((fd = open(filename, O_RDONLY)) < 0)
+      return -1;
+   ret = map_index(fd, header);
+   close(fd);
+   return ret;
+}
+
+/* Scans the trace for the samples of the job, writing them to a new index
+ * file that replaces the old one once complete, as other processes may
+ * have it mapped. If it can not be saved, a temporary file is used. The
+ * index is then mapped. A sample whose time is not after the previous one starts a new
+ * measurement, which is placed after the end of the previous ones. Only
+ * complete lines are taken. */
+int build_index(const char *filename, struct index_header *header) {
+   const char *line, *end, *it;
+   char *endp;
+   char *tmp_name;
+   int prefix[2], ret, fd;
+   struct entry entry;
+   double time, last = 0, offset = 0;
+   mode_t mask;
+   FILE *fff = NULL;
+
+   if(asprintf(&tmp_name, "%s.XXXXXX", filename) < 0)
+      return -1;
+   if((fd = mkstemp(tmp_name)) < 0 || (fff = fdopen(fd, "w+")) == NULL) {
+      fprintf(stderr,"Warning: Could not save index in %s. %s\n", filename, strerror(errno));
+      if(fd >= 0) {
+         close(fd);
+         unlink(tmp_name);
+      }
+      free(tmp_name);
+      tmp_name = NULL;
+      if((fff = tmpfile()) == NULL) {
+         fprintf(stderr,"Could not create index. %s\n", strerror(errno));
+         return -1;
+      }
+   }
+   else {
+      /* mkstemp only lets the owner read it */
+      mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0666 & ~mask);
+   }
+
+   madvise((void *)trace, trace_size, MADV_SEQUENTIAL);
+   header->count = 0;
+   fwrite(header, sizeof(*header), 1, fff);
+   for(line = trace; line < trace+trace_size; line = end+1) {
+      end = line_end(line);
+      if(end == trace+trace_size) break;
+      if((it = skip_prefix(line, end, prefix)) == NULL || !selected(prefix))
+         continue;
+      if(it == end || !(isdigit(*it) || *it == '.' || *it == '-')) continue;
+      time = strtod(it, &endp);
+      if(endp > end || endp == it) continue;
+
+      if(time+offset <= last)
+         offset = last;
+      last = time+offset;
+      entry.time = last;
+      entry.offset = line-trace;
+      fwrite(&entry, sizeof(entry), 1, fff);
+      header->count++;
+   }
+
+   /* The header is only valid once all the samples are written */
+   rewind(fff);
+   fwrite(header, sizeof(*header), 1, fff);
+   if(fflush(fff) != 0 || ferror(fff) || (ret = map_index(fileno(fff), header)) < 0) {
+      fprintf(stderr,"Could not write index. %s\n", strerror(errno));
+      if(tmp_name != NULL) unlink(tmp_name);
+      free(tmp_name);
+      fclose(fff);
+      return -1;
+   }
+   if(tmp_name != NULL && rename(tmp_name, filename) < 0) {
+      fprintf(stderr,"Warning: Could not save index in %s. %s\n", filename, strerror(errno));
+      unlink(tmp_name);
+   }
+   free(tmp_name);
+   fclose(fff);
+   return ret;
+}
+
+/* Returns the first sample after the given time */
+size_t find_time(double time) {
+   size_t low = 0, high = entry_count, mid;
+
+   while(low < high) {
+      mid = low + (high-low)/2;
+      if(entries[mid].time <= time) low = mid+1;
+      else high = mid;
+   }
+   return low;
+}
+
+/* Parses the columns of sample n into row of the current block. Missing
+ * values are taken as 0. */
+int parse_row(size_t n, int row) {
+   const char *line = trace+entries[n].offset;
+   const char *end = line_end(line);
+   const char *it;
+   char *endp;
+   int prefix[2], i;
+
+   it = skip_prefix(line, end, prefix);
+   strtod(it, &endp);
+   for(i = 0, it = endp; i < column_count; i++) {
+      while(it < end && *it == ' ') it++;
+      if(it < end) {
+         block_value[i*BLOCK+row] = strtod(it, &endp);
+         if(endp > end || endp == it) endp = (char *)end;
+         it = endp;
+      }
+      else
+         block_value[i*BLOCK+row] = 0;
+   }
+   return 0;
+}
+
+/* Reads samples from first up to last, but no more than a block. The
+ * time covered by each sample, since the previous one, is clipped to
+ * start and end. Returns the number of samples read. */
+size_t read_block(size_t first, size_t last, double start, double end) {
+   size_t n, i;
+   double previous;
+
+   n = last-first < BLOCK ? last-first : BLOCK;
+   previous = first > 0 ? entries[first-1].time : 0;
+   for(i = 0; i < n; i++) {
+      block_time[i] = entries[first+i].time;
+      block_dt[i] = (block_time[i] < end ? block_time[i] : end) - (previous > start ? previous : start);
+      if(block_dt[i] < 0) block_dt[i] = 0;
+      previous = block_time[i];
+      parse_row(first+i, i);
+   }
+   return n;
+}
+
+/* Writes the samples of the window as they are in the trace, without
+ * job numbers and with the time of the index. */
+void print_rows(size_t first, size_t last) {
+   const char *line, *end, *it;
+   char *endp;
+   int prefix[2], i;
+   size_t n;
+
+   fprintf(stdout,"time");
+   for(i = 0; i < column_count; i++)
+      fprintf(stdout," %s",columns[i]);
+   fprintf(stdout,"\n");
+   for(n = first; n < last; n++) {
+      line = trace+entries[n].offset;
+      end = line_end(line);
+      it = skip_prefix(line, end, prefix);
+      strtod(it, &endp);
+      fprintf(stdout,"%f",entries[n].time);
+      fwrite(endp, 1, end-endp+1, stdout);
+   }
+}
+
+/* Reduces the window to intervals of the same length, with the minimum,
+ * mean and maximum power of each column. The mean is weighted with the
+ * time covered by each sample, so that it gives the energy of the
+ * interval. The energy of the window is also accumulated. */
+void downsample(size_t first, size_t last, double start, double end, int points, double *energy) {
+   double width = (end-start)/points;
+   double min[MAX_COLUMNS], max[MAX_COLUMNS], sum[MAX_COLUMNS];
+   double duration, limit, lo, hi, acc, *v, *dt = block_dt;
+   size_t n, stop;
+   int i, k, bucket;
+
+   fprintf(stdout,"time");
+   for(i = 0; i < column_count; i++)
+      fprintf(stdout," %s_min %s_mean %s_max",columns[i],columns[i],columns[i]);
+   fprintf(stdout,"\n");
+   for(i = 0; i < column_count; i++)
+      energy[i] = 0;
+
+   for(bucket = 0; bucket < points && first < last; bucket++) {
+      /* Samples of the interval. The last one takes the sample that
+       * crosses the end of the window. */
+      limit = bucket == points-1 ? INFINITY : start+(bucket+1)*width;
+      for(stop = first; stop < last && entries[stop].time <= limit; stop++);
+      if(stop == first) continue;
+
+      duration = 0;
+      for(i = 0; i < column_count; i++) {
+         min[i] = INFINITY;
+         max[i] = -INFINITY;
+         sum[i] = 0;
+      }
+      while(first < stop) {
+         n = read_block(first, stop, start, end);
+         for(k = 0; k < n; k++)
+            duration += dt[k];
+         for(i = 0; i < column_count; i++) {
+            v = &block_value[i*BLOCK];
+            lo = min[i];
+            hi = max[i];
+            acc = sum[i];
+#pragma omp simd reduction(min:lo) reduction(max:hi) reduction(+:acc)
+            for(k = 0; k < n; k++) {
+               lo = v[k] < lo ? v[k] : lo;
+               hi = v[k] > hi ? v[k] : hi;
+               acc += v[k]*dt[k];
+            }
+            min[i] = lo;
+            max[i] = hi;
+            sum[i] = acc;
+         }
+         first += n;
+      }
+
+      fprintf(stdout,"%f",start+bucket*width);
+      for(i = 0; i < column_count; i++) {
+         fprintf(stdout," %f %f %f",min[i],duration > 0 ? sum[i]/duration : 0,max[i]);
+         energy[i] += sum[i];
+      }
+      fprintf(stdout,"\n");
+   }
+}
+
+/* Reduces the window to a number of points of a single column with the
+ * Largest Triangle Three Buckets algorithm. The first and last samples are
+ * kept, and from each bucket of samples in between the one that forms the
+ * largest triangle with the point chosen in the previous bucket and the
+ * mean of the next bucket. */
+void lttb(size_t first, size_t last, int points, int column) {
+   size_t count = last-first, n, k, i, chosen, b0, b1, b2;
+   double every, ax, ay, cx, cy, area, best, *v = &block_value[column*BLOCK];
+   int bucket;
+
+   fprintf(stdout,"time %s\n",columns[column]);
+   if(count == 0) return;
+   read_block(first, first+1, 0, INFINITY);
+   ax = entries[first].time;
+   ay = v[0];
+   fprintf(stdout,"%f %f\n",ax,ay);
+   if(count <= points) {
+      for(k = first+1; k < last; k += n) {
+         n = read_block(k, last, 0, INFINITY);
+         for(i = 0; i < n; i++)
+            fprintf(stdout,"%f %f\n",block_time[i],v[i]);
+      }
+      return;
+   }
+
+   every = (double)(count-2)/(points-2);
+   for(bucket = 0; bucket < points-2; bucket++) {
+      b0 = first+1+(size_t)(bucket*every);
+      b1 = first+1+(size_t)((bucket+1)*every);
+      b2 = bucket == points-3 ? last : first+1+(size_t)((bucket+2)*every);
+
+      /* Mean of the next bucket */
+      cx = cy = 0;
+      for(k = b1; k < b2; k += n) {
+         n = read_block(k, b2, 0, INFINITY);
+         for(i = 0; i < n; i++) {
+            cx += block_time[i];
+            cy += v[i];
+         }
+      }
+      cx /= b2-b1;
+      cy /= b2-b1;
+
+      /* Point of this bucket with the largest triangle */
+      best = -1;
+      chosen = b0;
+      for(k = b0; k < b1; k += n) {
+         n = read_block(k, b1, 0, INFINITY);
+         for(i = 0; i < n; i++) {
+            area = fabs((ax-cx)*(v[i]-ay) - (ax-block_time[i])*(cy-ay));
+            if(area > best) {
+               best = area;
+               chosen = k+i;
+            }
+         }
+      }
+      read_block(chosen, chosen+1, 0, INFINITY);
+      ax = block_time[0];
+      ay = v[0];
+      fprintf(stdout,"%f %f\n",ax,ay);
+   }
+   read_block(last-1, last, 0, INFINITY);
+   fprintf(stdout,"%f %f\n",block_time[0],v[0]);
+}
+
+/* Integrates the power of every column over the window. Each sample is
+ * the mean power since the previous one, so this recovers the energy
+ * counters sauna read. */
+void integrate(size_t first, size_t last, double start, double end, double *energy) {
+   double acc, *v, *dt = block_dt;
+   size_t n;
+   int i, k;
+
+   for(i = 0; i < column_count; i++)
+      energy[i] = 0;
+   while(first < last) {
+      n = read_block(first, last, start, end);
+      for(i = 0; i < column_count; i++) {
+         v = &block_value[i*BLOCK];
+         acc = energy[i];
+#pragma omp simd reduction(+:acc)
+         for(k = 0; k < n; k++)
+            acc += v[k]*dt[k];
+         energy[i] = acc;
+      }
+      first += n;
+   }
+}
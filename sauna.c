@@ -6,103 +6,239 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
-#include <sys/syscall.h>
+#include <math.h>
 #include <sys/sysinfo.h>
-#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sched.h>
 
 #if NVIDIA
 #include <nvml.h>
 #endif
-#if XEONPHI
-#include <miclib.h>
-#endif
+
+#include "libsauna.h"
 
 /* Global variables */
 
 /* BEGIN CONFGURATION */
 #define VERSION "1.4"
-//#define VERBOSE 1
 /* default interval beween measurements */
 useconds_t interval = 500000;
 /* Maximum number of cores in a machine */
 #define MAX_CORES	256
+/* default calibration window of the idle baseline in ms */
+#define BASELINE_WINDOW	2000
+/* directory where idle baselines are kept between runs by root. Other
+ * users keep them in $XDG_CACHE_HOME/sauna or ~/.cache/sauna */
+#define BASELINE_DIR	"/var/cache/sauna"
 /* END CONFGURATION */
 
-#if NVIDIA
-/* Flag to know if the NVIDIA API has been initialized */
-int nvml_up = 0;
-/* List and count of NVIDIA devices */
-nvmlDevice_t device_list[4];
-unsigned int device_count;
-/* Cumulative energy for NVIDIA devices */
-double nvml_energy[4];
-#endif
-/* Flag to know if perf RAPL events have been initialized */
-int rapl_up = 0;
-#if XEONPHI
-/* Cumulative energy for MIC devices */
-double mic_energy;
-/* Flag to know if mic connection has been initialized */
-int mic_up = 0;
-/* Handle for the mic device */
-struct mic_device *mdh;
-#endif
-/* The last time a measurement was made. Needed to convert energy to power in RAPL measurements */
-struct timeval last_time;
+/* Maximum number of NVIDIA devices */
+#define MAX_NVML	4
+/* Maximum number of jobs measured concurrently */
+#define MAX_JOBS	16
+/* Maximum number of nodes served by the collector */
+#define MAX_NODES	64
+/* Number of round trips used to estimate the clock offset of a node */
+#define SYNC_ROUNDS	8
+/* Maximum number of dimensions of a sweep and of values in each one */
+#define MAX_SWEEP	8
+#define MAX_SWEEP_VALUES	32
+/* Energy increase over the previous point that makes a point clearly dominated */
+#define SWEEP_MARGIN	0.02
+/* Energies in J closer to zero than this are too small to prune a sweep */
+#define SWEEP_MIN_ENERGY	1e-6
+
+/* Meter of the energy counters of all the jobs, and its channels */
+struct sauna *meter = NULL;
+const struct sauna_channel *channels;
+int channel_count = 0;
+/* Last sample of the channels, shared by all the jobs */
+struct sauna_snapshot *sample;
+/* Idle power of each channel */
+double *idle;
 /* Number of cores detected in the machine */
 int core_count = 0;
+/* Package of every cpu */
+int package_of[MAX_CORES];
+/* Cores whose RAPL counters are read, the union of the cores of all jobs */
 int query_cores[MAX_CORES];
-
-/* Textual description of the RAPL domains */
-#define NUM_RAPL_DOMAINS	4
-char rapl_domain_names[NUM_RAPL_DOMAINS][30]= {
-	"cores",
-	"gpu",
-	"pkg",
-	"ram",
-};
-/* File descriptors to read the RAPL counters */
-int fd[MAX_CORES][NUM_RAPL_DOMAINS];
-/* Energy at the begining of the ROI */
-long long first_value[MAX_CORES][NUM_RAPL_DOMAINS];
-/* Last value read from RAPL counters to compute power from energy */
-long long last_value[MAX_CORES][NUM_RAPL_DOMAINS];
-/* Scale factor when reading RAPL counters */
-double scale[NUM_RAPL_DOMAINS];
+/* Calibration window of the idle baseline in ms, 0 to report gross power */
+long baseline_window = 0;
+/* Flag to calibrate the idle baseline even if it is in the cache */
+int flag_recalibrate = 0;
+/* Directory and file of the cache of baselines */
+char baseline_dir[BUFSIZ];
+char baseline_cache[BUFSIZ+16];
 /* File desctiptor for output file */
 FILE *out;
+/* Flag to indicate if only the ROI has to be measured */
+int flag_roi = 0;
+/* Flag to force output of total energy and time */
+int flag_total = 0;
+/* Flag to know if the output is streamed to a collector */
+int flag_stream = 0;
+
+/* Buffer to assemble lines read from a file descriptor */
+struct line_buf {
+   char *line;
+   size_t len, size;
+};
 
-/* Functions */
-void usage(int argc, char **argv);
-void help(int argc, char **argv);
-
+/* States of a job regarding its measurements */
+#define JOB_WAITING	0
+#define JOB_MEASURING	1
+#define JOB_DONE	2
+
+/* A command measured by sauna. All jobs share the sampler, but each one
+ * has its own cores, devices, ROI and energy accounting. */
+struct job {
+   /* NULL terminated command line */
+   char **args;
+   /* Lists of cores and NVIDIA devices given with -c and -g */
+   char *core_spec;
+   char *gpu_spec;
+   /* Pid of child and reading end of the pipe connected to its stdout */
+   pid_t pid;
+   int stdout_fd;
+   /* Partial line read from the child */
+   struct line_buf output;
+   /* One of JOB_WAITING, JOB_MEASURING or JOB_DONE */
+   int state;
+   /* Indices in query_cores of the cores of this job */
+   int cores[MAX_CORES];
+   int ncores;
+   /* Channels of the meter measured for this job */
+   int *channels;
+   int nchannels;
+   /* Start of the measurements of the job. The time of every sample is
+    * relative to it. */
+   struct timeval last_time;
+   /* Time and energy of the last measurement, for the sweep */
+   double duration;
+   double energy;
+   /* Counters at the begining of the ROI */
+   struct sauna_snapshot *first;
+   /* Last counters read to compute power from energy */
+   struct sauna_snapshot *last;
+   /* Energy consumed since the last sample, or since the first */
+   struct sauna_energy *delta;
 #if NVIDIA
-int list_nvidia_devices(nvmlDevice_t *device_list, unsigned int *device_count);
-void reset_nvml();
-void query_nvml_device_power(int device, long long delta);
-void query_nvml_device_energy(int device);
+   /* NVIDIA devices of this job */
+   int gpus[MAX_NVML];
+   int ngpus;
 #endif
+};
 
-#if XEONPHI
-int init_mic();
-void reset_mic();
-void query_mic_device_power(long long delta);
-void query_mic_device_energy();
-int close_mic();
-void print_mic_error(const char *msg, const char *device_name);
-#endif
+/* A sauna instance streaming its output to the collector */
+struct node {
+   char host[64];
+   int fd;
+   struct line_buf input;
+   /* Clock offset of the node relative to the collector and the round
+    * trip time of the exchange it was estimated from */
+   double offset;
+   double rtt;
+   /* Start of the measurements of each job, relative to the beginning
+    * of the merged trace */
+   double start[MAX_JOBS];
+   /* Columns of each job added to the total energy */
+   char *sum_mask[MAX_JOBS];
+   int sum_count[MAX_JOBS];
+};
+
+struct node nodes[MAX_NODES];
+int node_count = 0;
+/* Time span and energy of the whole distributed job */
+double first_start = -1, last_end = -1;
+double total_energy = 0;
+
+/* Kinds of settings swept */
+#define SWEEP_ENV	0
+#define SWEEP_FREQ	1
+#define SWEEP_CLOCKS	2
+
+/* A dimension of the grid of settings swept */
+struct sweep_dim {
+   int type;
+   /* Name of the environment variable, or of the setting */
+   char *name;
+   char *values[MAX_SWEEP_VALUES];
+   int count;
+};
+
+/* A point of the sweep that has been measured */
+struct sweep_point {
+   int index[MAX_SWEEP];
+   double time;
+   double energy;
+};
+
+struct sweep_dim sweep[MAX_SWEEP];
+int sweep_count = 0;
+/* Flag to know if cpufreq or clock settings have been changed */
+int sweep_up = 0;
+/* Governor set on the cpus during the sweep */
+char *sweep_governor = NULL;
+/* Cpus in the packages of the measured cores, and their original settings */
+int sweep_cpus[MAX_CORES];
+int sweep_cpu_count = 0;
+char saved_max_freq[MAX_CORES][32];
+char saved_governor[MAX_CORES][32];
+
+struct job jobs[MAX_JOBS];
+int job_count = 0;
+/* Number of jobs in JOB_MEASURING state */
+int active_jobs = 0;
+
+/* Functions */
+void usage(int argc, char **argv);
+void help(int argc, char **argv);
 
 void close_and_exit();
+int open_meter();
+void run_jobs();
+void job_totals(struct job *job);
+int add_sweep_dim(int type, char *name, char *values);
+int read_cpu_setting(int cpu, const char *setting, char *value, size_t size);
+void read_packages(int nprocs);
+int check_job_packages();
+int write_cpu_setting(int cpu, const char *setting, const char *value);
+int init_sweep();
+void apply_sweep_setting(struct sweep_dim *dim, char *value);
+void restore_sweep();
+void terminate_handler(int signo);
+void print_sweep_point(const char *tag, struct sweep_point *point);
+int dominates(struct sweep_point *a, struct sweep_point *b, double margin);
+void run_sweep();
 void alarm_handler (int signo);
-void print_total_energy();
-int init_rapl_perf();
-void reset_rapl_perf();
-void query_rapl_device_power(int core,long long delta);
-void query_rapl_device_energy(int core);
-void close_rapl_perf();
+void print_job_prefix(struct job *job);
+void print_header(struct job *job);
+void print_total_energy(struct job *job);
+int parse_list(const char *spec, int *list, int max, int limit, const char *what);
+int parse_job_cores(struct job *job, int nprocs);
+void start_job(struct job *job);
+void stop_job(struct job *job);
+int read_lines(int fd, struct line_buf *buf, void (*handle)(char *line, void *arg), void *arg);
+void handle_job_line(char *line, void *arg);
+double now_seconds();
+int read_line(int fd, char *line, size_t size);
+int connect_collector(char *address);
+int run_collector(int port);
+void handle_node_line(char *line, void *arg);
+void baseline_key(char *key, size_t size);
+int baseline_path();
+FILE *open_baseline_cache(int flags);
+int load_baseline();
+void save_baseline();
+void calibrate_baseline();
 
 int main(int argc, char **argv)
 {
@@ -110,51 +246,33 @@ int main(int argc, char **argv)
    int i,j;
    /* getopt support variables */
    int c = 0;
-   /* Flag to indicate if only the ROI has to be measured */
-   int flag_roi = 0;
-   /* Flag to force output of total energy and time */
-   int flag_total = 0;
+   /* Number of processors in the machine */
+   int nprocs;
 
-   /* Pid of child and return status */
-   pid_t child_id;
-   int status;
-   /* Pipe to connect child's stdout to parent and file descrptor for the parent */
-   int pipe_stdout[2];
-   FILE *child_stdout;
-   /* Array of strings to pass command line to child */
-   char *exec_args[99];
-   /* Pointer to the line read from the child, its current
-    * size and the number of characters in it */
-   char *line = NULL;
-   size_t len = 0;
-   ssize_t read;
-#if NVIDIA
-   /* Return value of NVIDIA API */
-   nvmlReturn_t result;
-#endif
    /* To convert options to integers */
    char* endp;
    long l;
+   /* Port where the collector listens and address of the collector */
+   int collector_port = 0;
+   char *collector = NULL;
+   struct job *job = &jobs[0];
    /* Set default output file */
    out = stderr;
 
    /* Get number of cores */
-   core_count = get_nprocs();
-   if(core_count > MAX_CORES) {
+   nprocs = get_nprocs();
+   if(nprocs > MAX_CORES) {
       fprintf(stderr,"Too many processors. Increase MAX_CORES and recompile.\n");
       return -1;
    }
-   for(i=0; i<core_count; i++) {
-      query_cores[i] = i;
-   }
 
    /* Disable getopt error reporting */
    opterr = 0;
-   /* Process options with getopt */
-   while ((c = getopt (argc, argv, "o::c::r::h::v::i::t::")) != -1)
+   /* Process options with getopt, stopping at the first non option
+    * so that the options of the command are left untouched */
+   while ((c = getopt (argc, argv, "+o::c::g::r::h::v::i::t::a::n::s::b::B::F::G::C::E::")) != -1)
 
       switch (c) {
-         char *it,*end;
          case 'o':
             if((out = fopen(optarg,"w")) == NULL) {
                fprintf(stderr,"Could not open output file %s for writing. %s\n", optarg, strerror(errno));
@@ -168,26 +286,29 @@ int main(int argc, char **argv)
             flag_total = 1;
             break;
          case 'c':
-            if(optarg == NULL || *optarg == '\0') break;
-            it = optarg;
-            end = optarg;
-            int i = 0;
-            while(*end) {
-               int n = strtol(it, &end, 10);
-               if(n > core_count) {
-                  fprintf(stderr,"Specified a core that does not exisit.\n");
-                  close_and_exit(EXIT_FAILURE);
-               }
-               query_cores[i++] = n;
-               if(i > core_count) {
-                  fprintf(stderr,"Specified too many cores.\n");
-                  close_and_exit(EXIT_FAILURE);
-               }
-               while (*end == ',') { end++; }
-               it = end;
+            job->core_spec = optarg;
+            break;
+         case 'g':
+            job->gpu_spec = optarg;
+            break;
+         case 'a':
+            if (!optarg || (collector_port = atoi(optarg)) <= 0) {
+               fprintf(stderr,"Invalid port %s for the collector.\n", optarg?optarg:"(null)");
+               close_and_exit(EXIT_FAILURE);
+            }
+            break;
+         case 'n':
+            if (!optarg || (node_count = atoi(optarg)) <= 0 || node_count > MAX_NODES) {
+               fprintf(stderr,"Invalid number of nodes %s - expecting 1 to %d.\n", optarg?optarg:"(null)", MAX_NODES);
+               close_and_exit(EXIT_FAILURE);
+            }
+            break;
+         case 's':
+            if (!optarg || strrchr(optarg,':') == NULL) {
+               fprintf(stderr,"Invalid collector %s - expecting <host>:<port>.\n", optarg?optarg:"(null)");
+               close_and_exit(EXIT_FAILURE);
             }
-            core_count = i;
-            // for(i = 0; i < core_count; i++) fprintf(stderr,"%d\n",query_cores[i]);
+            collector = optarg;
             break;
          case 'i':
             endp = NULL;
@@ -202,6 +323,37 @@ int main(int argc, char **argv)
             }
             interval = l*1000;
             break;
+         case 'F':
+            if(add_sweep_dim(SWEEP_FREQ, "cpu_freq", optarg) < 0)
+               close_and_exit(EXIT_FAILURE);
+            break;
+         case 'C':
+            if(add_sweep_dim(SWEEP_CLOCKS, "gpu_clocks", optarg) < 0)
+               close_and_exit(EXIT_FAILURE);
+            break;
+         case 'E':
+            if(!optarg || (endp = strchr(optarg,'=')) == NULL) {
+               fprintf(stderr,"Invalid environment sweep %s - expecting <variable>=<values>.\n", optarg?optarg:"(null)");
+               close_and_exit(EXIT_FAILURE);
+            }
+            *endp = '\0';
+            if(add_sweep_dim(SWEEP_ENV, optarg, endp+1) < 0)
+               close_and_exit(EXIT_FAILURE);
+            break;
+         case 'G':
+            sweep_governor = optarg;
+            break;
+         case 'B':
+            flag_recalibrate = 1;
+         case 'b':
+            endp = NULL;
+            l = BASELINE_WINDOW;
+            if (optarg && ((l=strtol(optarg, &endp, 10)) <= 0 || *endp)) {
+               fprintf(stderr,"Invalid calibration window %s - expecting a number of miliseconds.\n", optarg);
+               close_and_exit(EXIT_FAILURE);
+            }
+            baseline_window = l;
+            break;
          case 'v':
             fprintf(stderr,"sauna %s\n",VERSION);
             close_and_exit(0);
@@ -217,154 +369,207 @@ int main(int argc, char **argv)
             usage(argc, argv);
             close_and_exit (0);
       }
+
+   /* In aggregator mode there is no command, just merge the output of the nodes */
+   if(collector_port > 0) {
+      if(node_count == 0) node_count = 1;
+      close_and_exit(run_collector(collector_port) < 0 ? EXIT_FAILURE : 0);
+   }
   
-   /* Ensure that the number of arguments is correct. */
-   if(optind == argc) {
-      printf ("Error: Insufficient arguments.\n");
-      usage(argc, argv);
-      close_and_exit (0);
+   /* Split the rest of the command line in jobs separated by ":". Each job
+    * but the first may start with its own -c and -g options. The separators
+    * are replaced by NULL so that each job is a NULL terminated array of
+    * strings that can be passed to execv, after the fork. */
+   i = optind;
+   while(1) {
+      if(job_count == MAX_JOBS) {
+         fprintf(stderr,"Too many jobs. Increase MAX_JOBS and recompile.\n");
+         close_and_exit(EXIT_FAILURE);
+      }
+      job = &jobs[job_count++];
+      for(; job_count > 1 && i < argc && argv[i][0] == '-'; i++) {
+         if(argv[i][1] == 'c') job->core_spec = argv[i]+2;
+         else if(argv[i][1] == 'g') job->gpu_spec = argv[i]+2;
+         else break;
+      }
+      /* Ensure that the number of arguments is correct. */
+      if(i == argc || strcmp(argv[i],":") == 0) {
+         printf ("Error: Insufficient arguments.\n");
+         usage(argc, argv);
+         close_and_exit (0);
+      }
+      job->args = &argv[i];
+      while(i < argc && strcmp(argv[i],":") != 0) i++;
+      if(i == argc) break;
+      argv[i++] = NULL;
    }
 
-   /* Prepare a NULL terminated array of strings to pass to execv, after the fork. */
-   for(i = optind, j = 0; i < argc; i++, j++) {
-      exec_args[j] = argv[i];
+   /* Resolve the cores of each job, opening RAPL counters only once
+    * for cores shared by several jobs. */
+   for(j = 0; j < job_count; j++) {
+      if(parse_job_cores(&jobs[j], nprocs) < 0)
+         close_and_exit(EXIT_FAILURE);
    }
-   exec_args[j] = NULL;
+   read_packages(nprocs);
+   if(check_job_packages() < 0)
+      close_and_exit(EXIT_FAILURE);
 
-   /* Prepare communication channel with the child process. */
-   if(pipe(pipe_stdout) < 0) {
-      printf ("Error: could not open pipe.\n");
-      close_and_exit(0);
-   }
-   
-   /* Create a file descriptor to the reading end of the pipe. */
-   if((child_stdout = fdopen(pipe_stdout[0], "r")) == NULL) {
-      printf ("Error: could create file descriptor to pipe.\n");
-      close_and_exit(0);
+   /* Open the energy counters and devices of all the jobs */
+   if(open_meter() < 0) {
+      printf ("Error: Failed to open energy counters.\n");
+      close_and_exit (0);
    }
 
-#if NVIDIA
-   /* Initialize NVIDIA API */
-   if ((result = nvmlInit()) != NVML_SUCCESS) {
-      fprintf(stderr,"Error: Failed to initialize NVML: %s\n", nvmlErrorString(result));
-      close_and_exit(0);
+   if(sweep_count > 0 && collector != NULL) {
+      fprintf(stderr,"A sweep can not be streamed to the collector.\n");
+      close_and_exit(EXIT_FAILURE);
    }
-   nvml_up = 1;
-
-   if((result = list_nvidia_devices(device_list,&device_count)) != NVML_SUCCESS) {
-      fprintf(stderr,"Error: Failed to list NVIDIA devices: %s\n", nvmlErrorString(result));
-      close_and_exit(0);
+   /* Save the settings that the sweep changes */
+   if(sweep_count > 0 && init_sweep() < 0)
+      close_and_exit(EXIT_FAILURE);
+
+   /* Measure the idle power before the children run, unless it is known
+    * from a previous run with the same configuration */
+   if(baseline_window > 0 && (flag_recalibrate || load_baseline() < 0)) {
+      calibrate_baseline();
+      save_baseline();
    }
-   /* TODO Check that MAX_NVML > device_count */
-#endif
 
-   /* Initialize perf RAPL */
-   if(init_rapl_perf() < 0) {
-      printf ("Error: Failed to intialize perf RAPL events.\n");
+   /* Send the output to the collector once the clocks are aligned */
+   if(collector != NULL && connect_collector(collector) < 0) {
+      printf ("Error: Failed to connect to collector %s.\n", collector);
       close_and_exit (0);
    }
 
-#if XEONPHI
-   /* Initialize perf RAPL */
-   if(init_mic() < 0) {
-      printf ("Error: Failed to intialize XeonPhi device.\n");
-      close_and_exit (0);
-   }
-#endif
+   signal (SIGALRM, alarm_handler);
 
-   /* Fork child process */
-   if((child_id = fork()) < 0) {
-      printf ("Error: unable to fork child process.\n");
-      close_and_exit (0);
+   /* Run the command once, or once for every point of the sweep */
+   if(sweep_count > 0)
+      run_sweep();
+   else
+      run_jobs();
+
+   /* Release memory allocated to lines */
+   for(j = 0; j < job_count; j++) {
+      if(jobs[j].output.line)
+         free(jobs[j].output.line);
    }
 
-   if(child_id == 0) {
-      /* Connect stdout of child process to pipe. */
-      close(pipe_stdout[0]); 
-      if(dup2(pipe_stdout[1],1) < 0) {
-         printf ("Error: failed to duplicate file descriptor in child process.\n");
-         close_and_exit(1);
+   close_and_exit(1);
+   return 0;
+}
+
+/* Forks the children of all the jobs and measures them until they finish */
+void run_jobs() {
+   int j;
+   struct job *job;
+   /* Return status of children */
+   int status;
+   /* Pipe to connect child's stdout to parent */
+   int pipe_stdout[2];
+   /* Cores the child is pinned to */
+   cpu_set_t cpus;
+   int k, cpu, nprocs = get_nprocs();
+   /* Descriptors polled for output of the children */
+   struct pollfd fds[MAX_JOBS];
+   int running;
+
+   for(j = 0; j < job_count; j++) {
+      job = &jobs[j];
+      job->state = JOB_WAITING;
+      job->output.len = 0;
+      job->duration = 0;
+      job->energy = 0;
+
+      /* Prepare communication channel with the child process. The reading
+       * end is not inherited by the other children. */
+      if(pipe2(pipe_stdout, O_CLOEXEC) < 0) {
+         printf ("Error: could not open pipe.\n");
+         close_and_exit(0);
       }
 
-      /* The child process is replaced by the program supplied by the user. */
-      if(execvp(exec_args[0],exec_args) == -1) {
-         printf ("Error: failed to exec \"%s\" in child process. %s\n",exec_args[0],strerror(errno));
-/*         for(i = 0; exec_args[i] != NULL; i++) 
-              fprintf(stderr,"%s%s",exec_args[i],exec_args[i+1] != NULL ? " ": "");
-           fprintf(stderr,"\n");
-          */
+      /* Fork child process */
+      if((job->pid = fork()) < 0) {
+         printf ("Error: unable to fork child process.\n");
+         close_and_exit (0);
       }
-      close_and_exit(1);
-   }
 
-   signal (SIGALRM, alarm_handler);
-   close(pipe_stdout[1]); 
-   
-   /* Print headers */
-   fprintf(out,"time");
-   for(i=0; i<core_count; i++)
-      for(j=0;j<NUM_RAPL_DOMAINS;j++) {
-         if (fd[i][j]!=-1) {
-            fprintf(out," core_%d_%s",query_cores[i],rapl_domain_names[j]);
+      if(job->pid == 0) {
+         /* Connect stdout of child process to pipe. */
+         if(dup2(pipe_stdout[1],1) < 0) {
+            printf ("Error: failed to duplicate file descriptor in child process.\n");
+            _exit(EXIT_FAILURE);
          }
+
+         /* With several jobs, run each child on the packages of its cores,
+          * so that its energy is not spread over those of other jobs */
+         CPU_ZERO(&cpus);
+         for(cpu = 0; cpu < nprocs; cpu++)
+            for(k = 0; k < job->ncores; k++)
+               if(package_of[cpu] == package_of[query_cores[job->cores[k]]])
+                  CPU_SET(cpu, &cpus);
+         if(job_count > 1 && sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            printf ("Error: failed to pin child process to its cores. %s\n",strerror(errno));
+            _exit(EXIT_FAILURE);
+         }
+
+         /* The child process is replaced by the program supplied by the user. */
+         if(execvp(job->args[0],job->args) == -1) {
+            printf ("Error: failed to exec \"%s\" in child process. %s\n",job->args[0],strerror(errno));
+         }
+         /* The settings of the sweep are restored by the parent */
+         _exit(EXIT_FAILURE);
       }
-#if NVIDIA
-   for(i=0; i<device_count; i++)
-     fprintf(out," nvd_%d",i);
-#endif
-#if XEONPHI
-   fprintf(out," mic");
-#endif
-   fprintf(out,"\n");
+
+      close(pipe_stdout[1]); 
+      job->stdout_fd = pipe_stdout[0];
+      fds[j].fd = pipe_stdout[0];
+      fds[j].events = POLLIN;
+   }
+
+   /* Print headers */
+   for(j = 0; j < job_count; j++)
+      print_header(&jobs[j]);
 
    /* If the ROI analysis flag is not set, start measurements immediately */
    if(! flag_roi) {
-      reset_rapl_perf();
-#if NVIDIA
-      reset_nvml();
-#endif
-      ualarm(interval, interval);
-      gettimeofday(&last_time,NULL);
+      for(j = 0; j < job_count; j++)
+         start_job(&jobs[j]);
    }
-   /* The master process reads stdin of the child process */
-   while ((read = getline(&line, &len, child_stdout)) != -1) {
-      /* If ROI analysis is set, and begining of ROI is detected start measurements */
-      if(flag_roi && strstr(line, "++ROI")) {
-         reset_rapl_perf();
-#if NVIDIA
-         reset_nvml();
-#endif
-         ualarm(interval, interval);
-         gettimeofday(&last_time,NULL);
+   /* The master process reads stdout of the child processes */
+   running = job_count;
+   while (running > 0) {
+      if(poll(fds, job_count, -1) < 0) {
+         /* The sampler interrupts the wait */
+         if(errno == EINTR) continue;
+         fprintf(stderr,"Error: failed to wait for output of children. %s\n", strerror(errno));
+         break;
       }
-      /* Stop measurements at the end of the ROI */
-      else if(flag_roi && strstr(line, "--ROI")) {
-         flag_roi = 1;
-         ualarm(0, interval);
-         if(flag_total != 0) print_total_energy();
+      for(j = 0; j < job_count; j++) {
+         if(fds[j].fd < 0 || fds[j].revents == 0) continue;
+         if(read_lines(fds[j].fd,&jobs[j].output,handle_job_line,&jobs[j]) == 0) {
+            /* Stop measurements when the child dies */
+            if(jobs[j].state == JOB_MEASURING) stop_job(&jobs[j]);
+            jobs[j].state = JOB_DONE;
+            close(fds[j].fd);
+            fds[j].fd = -1;
+            running--;
+         }
       }
-      fputs(line, stdout);
    }
-   /* Stop measurements when the child dies */
-   if(flag_roi < 1) {
-      ualarm(0, interval);
-      if(flag_total != 0) print_total_energy();
-   }
-
-   /* Reap child */
-   waitpid(child_id,&status,0);
-   fclose(child_stdout);
 
-   /* Release memory allocated to line */
-   if(line)
-      free(line);
+   /* Reap children */
+   for(j = 0; j < job_count; j++)
+      waitpid(jobs[j].pid,&status,0);
 
-   close_and_exit(1);
-   return 0;
 }
 
 void usage(int argc, char **argv) {
-      printf ("Usage: %s [-rtvh] [-o<file>] [-i<ms>] <command> [<arguments>]\n", argv[0]);
+      printf ("Usage: %s [-rtvh] [-b[<ms>]|-B[<ms>]] [-o<file>] [-i<ms>] [-s<host>:<port>] [-c<cores>] [-g<devices>] <command> [<arguments>]\n"
+              "       [: [-c<cores>] [-g<devices>] <command> [<arguments>]]...\n"
+              "       %s [-rvh] [-b[<ms>]|-B[<ms>]] [-o<file>] [-i<ms>] [-c<cores>] [-g<devices>] [-F<freqs>] [-G<governor>]\n"
+              "       [-C<clocks>] [-E<variable>=<values>]... <command> [<arguments>]\n"
+              "       %s -a<port> [-n<nodes>] [-o<file>]\n", argv[0], argv[0], argv[0]);
 }
 
 void help(int argc, char **argv) {
@@ -384,402 +589,1002 @@ void help(int argc, char **argv) {
             "\n"
             "   -i Sets the sampling interval in ms. Default 500ms. Interval can not exceed 999ms. \n"
             "\n"
+            "   -c Comma separated list of cores whose RAPL counters are measured. Default all.\n"
+            "\n"
+            "   -g Comma separated list of NVIDIA devices that are measured. Default all.\n"
+            "\n"
+            "   -s Streams the output to the collector listening at <host>:<port> instead of writing\n"
+            "      it to the output file. Totals are always sent.\n"
+            "\n"
+            "   -a Runs as the collector of a distributed job, listening on <port> for the number of\n"
+            "      nodes given with -n, one by default. The clock of each node is aligned with that\n"
+            "      of the collector, and their samples are merged in a single trace, in order of\n"
+            "      arrival, where each line is preceded by the numbers of the node and the command.\n"
+            "      The time and energy of the whole job are written at the end.\n"
+            "\n"
+            "   -b Subtracts the idle power of every channel from the measurements. It is calibrated\n"
+            "      over a window of the given ms, 2000 by default, before running <command>, unless\n"
+            "      it is found in the cache for this host and configuration, which is kept in\n"
+            "      " BASELINE_DIR "/baseline for root, and in ~/.cache/sauna/baseline for other\n"
+            "      users. It can not be used along with -F, -G or -C.\n"
+            "\n"
+            "   -B Same as -b, but the idle power is always calibrated again and saved in the cache.\n"
+            "\n"
+            "   -F Comma separated list of maximum cpu frequencies in kHz to sweep. They are set with\n"
+            "      cpufreq on every cpu in the packages of the measured cores.\n"
+            "\n"
+            "   -G Sets the cpufreq governor of those cpus during the sweep.\n"
+            "\n"
+            "   -C Comma separated list of NVIDIA application clocks to sweep, as <memory>:<graphics>\n"
+            "      in MHz. They are set on the measured devices.\n"
+            "\n"
+            "   -E Sweeps an environment variable given as <variable>=<values>, with a comma separated\n"
+            "      list of values, such as OMP_NUM_THREADS=1,2,4. It can be given several times.\n"
+            "\n"
+            "      With any of -F, -C or -E, <command> is run once for every combination of settings.\n"
+            "      The last dimension given varies first, and its remaining values are skipped once a\n"
+            "      setting is clearly worse than the previous one in both time and energy. A \"Point:\"\n"
+            "      line with the settings, time and energy follows the output of each run, and the\n"
+            "      points of the Pareto frontier are written at the end in \"Pareto:\" lines. Settings\n"
+            "      are restored when finished.\n"
+            "\n"
             "   -v Show version number.\n"
             "\n"
             "   -h Displays this message.\n"
             "\n"
+            "Several commands separated by \":\" can be measured concurrently, each one with its own\n"
+            "cores and devices. As RAPL measures whole packages, their cores must belong to different\n"
+            "packages, and each command is pinned to the cpus of its packages. Every line of the\n"
+            "output is then preceded by the number of the command it refers to. A single sampler\n"
+            "serves all of them, and each one has its own ROI and energy totals.\n"
+            "\n"
             );
 }
 
+void close_and_exit(int code) {
+   if(sweep_up)
+      restore_sweep();
+   if(meter != NULL)
+      sauna_close(meter);
+   exit(code);
+}
+
+/* Opens a meter on the cores of all the jobs and on every device, and
+ * selects the channels of each job. */
+int open_meter() {
+   struct job *job;
+   int i,j,k,device_count = 0;
+
+   if((meter = sauna_open(query_cores, core_count, NULL, 0, SAUNA_RAPL | SAUNA_NVML | SAUNA_MIC)) == NULL)
+      return -1;
+   channels = sauna_channels(meter);
+   channel_count = sauna_channel_count(meter);
+   for(i = 0; i < channel_count; i++)
+      if(channels[i].type == SAUNA_NVML) device_count++;
+   if((sample = sauna_snapshot_new(meter)) == NULL || (idle = calloc(channel_count+1, sizeof(double))) == NULL)
+      return -1;
+
+   for(j = 0; j < job_count; j++) {
+      job = &jobs[j];
 #if NVIDIA
-int list_nvidia_devices(nvmlDevice_t *device_list, unsigned int *device_count) {
-   int i;
-   nvmlReturn_t result;
-   char name[NVML_DEVICE_NAME_BUFFER_SIZE];
+      /* Without -g a job accounts for all the devices */
+      if(job->gpu_spec == NULL) {
+         for(i = 0; i < device_count && i < MAX_NVML; i++)
+            job->gpus[i] = i;
+         job->ngpus = i;
+      }
+      else if((job->ngpus = parse_list(job->gpu_spec,job->gpus,MAX_NVML,device_count,"device")) < 0)
+         return -1;
+#endif
+      if((job->channels = malloc((channel_count+1)*sizeof(int))) == NULL ||
+         (job->first = sauna_snapshot_new(meter)) == NULL ||
+         (job->last = sauna_snapshot_new(meter)) == NULL ||
+         (job->delta = sauna_energy_new(meter)) == NULL)
+         return -1;
+
+      /* Channels follow the order of the cores and devices of the job.
+       * There is a single XeonPhi card, so only the first job accounts
+       * for it. */
+      job->nchannels = 0;
+      for(k = 0; k < job->ncores; k++)
+         for(i = 0; i < channel_count; i++)
+            if(channels[i].type == SAUNA_RAPL && channels[i].index == query_cores[job->cores[k]])
+               job->channels[job->nchannels++] = i;
+#if NVIDIA
+      for(k = 0; k < job->ngpus; k++)
+         for(i = 0; i < channel_count; i++)
+            if(channels[i].type == SAUNA_NVML && channels[i].index == job->gpus[k])
+               job->channels[job->nchannels++] = i;
+#endif
+      for(i = 0; i < channel_count && j == 0; i++)
+         if(channels[i].type == SAUNA_MIC)
+            job->channels[job->nchannels++] = i;
+   }
+   return 0;
+}
+
+void alarm_handler (int signo)
+{
+   int i,j,c;
+   struct timeval time;
+   double now, elapsed;
+   struct job *job;
 
-   if ((result = nvmlDeviceGetCount(device_count)) != NVML_SUCCESS) {
-      fprintf(stderr,"Error: Failed to query device count: %s\n", nvmlErrorString(result));
+   gettimeofday(&time,NULL);
+
+   /* Take a single sample of every counter and device, which is then
+    * shared by all the jobs being measured */
+   if(sauna_snapshot(meter, sample) < 0)
       close_and_exit(0);
+
+   for(j=0; j<job_count; j++) {
+      job = &jobs[j];
+      if(job->state != JOB_MEASURING) continue;
+      now = (time.tv_sec-job->last_time.tv_sec)+(time.tv_usec-job->last_time.tv_usec)*1e-6;
+      sauna_diff(meter, job->last, sample, job->delta);
+      elapsed = job->delta->time*1e-9;
+      print_job_prefix(job);
+      fprintf(out,"%f ",(double) now);
+      for(i=0; i<job->nchannels; i++) {
+         c = job->channels[i];
+         fprintf(out,"%lf ",(elapsed > 0 ? job->delta->channel[c]/elapsed : 0) - idle[c]);
+      }
+      fprintf(out,"\n");
+      sauna_snapshot_copy(meter, job->last, sample);
    }
-#ifdef VERBOSE
-   fprintf(stderr,"Found %d NVI device%s\n\n", *device_count, *device_count != 1 ? "s" : "");
-#endif
+}
 
-   for (i = 0; i < *device_count; i++)
-   {
-       // Query for device handle to perform operations on a device
-       // You can also query device handle by other features like:
-       // nvmlDeviceGetHandleBySerial
-       // nvmlDeviceGetHandleByPciBusId
-       if ((result = nvmlDeviceGetHandleByIndex(i, &device_list[i])) != NVML_SUCCESS)
-       { 
-       //   fprintf(stderr,"Failed to get handle for device %i: %s\n", i, nvmlErrorString(result));
-          return result;
-       }
-
-       if ((result = nvmlDeviceGetName(device_list[i], name, NVML_DEVICE_NAME_BUFFER_SIZE)) != NVML_SUCCESS)
-       { 
-       //   fprintf(stderr,"Failed to get name of device %i: %s\n", i, nvmlErrorString(result));
-          return result;
-       }
-       nvml_energy[i] = 0;
-   }
-   return NVML_SUCCESS;
-}
-
-void reset_nvml() {
+/* With several jobs, or when streaming to the collector, every line is
+ * preceded by the number of the job */
+void print_job_prefix(struct job *job) {
+   if(job_count > 1 || flag_stream)
+      fprintf(out,"%d ",(int)(job-jobs));
+}
+
+void print_header(struct job *job) {
    int i;
-   for (i = 0; i < device_count; i++)
-      nvml_energy[i] = 0;
+
+   print_job_prefix(job);
+   fprintf(out,"time");
+   for(i=0; i<job->nchannels; i++)
+      fprintf(out," %s",channels[job->channels[i]].name);
+   fprintf(out,"\n");
+
+   /* The collector needs the columns that add up to the energy of the job */
+   if(flag_stream) {
+      print_job_prefix(job);
+      fprintf(out,"Whole:");
+      for(i=0; i<job->nchannels; i++)
+         fprintf(out," %d",channels[job->channels[i]].whole);
+      fprintf(out,"\n");
+   }
+
+   /* Idle power subtracted from every column */
+   if(baseline_window == 0) return;
+   print_job_prefix(job);
+   fprintf(out,"Baseline:");
+   for(i=0; i<job->nchannels; i++)
+      fprintf(out," %f",idle[job->channels[i]]);
+   fprintf(out,"\n");
 }
- 
-void query_nvml_device_power(int device, long long delta) {
-   nvmlReturn_t result;
-   unsigned int power_usage;
-   
-   if ((result = nvmlDeviceGetPowerUsage (device_list[device], &power_usage)) != NVML_SUCCESS) {
-      if (result == NVML_ERROR_NOT_SUPPORTED) {
-         fprintf(stderr,"\t This is not CUDA capable device\n");
+
+void print_total_energy(struct job *job) {
+   int i,c;
+
+   print_job_prefix(job);
+   fprintf(out,"Totals: ");
+   fprintf(out,"%f ",job->duration);
+   for(i=0; i<job->nchannels; i++) {
+      c = job->channels[i];
+      fprintf(out,"%lf ",job->delta->channel[c] - idle[c]*job->duration);
+   }
+   fprintf(out,"\n");
+}
+
+/* Computes the time and energy of a job since its measurements started.
+ * Only whole channels add up. As jobs do not share packages, the first
+ * core of each package in the meter is also the first in its job. */
+void job_totals(struct job *job) {
+   int i,c;
+
+   if(sauna_snapshot(meter, sample) < 0)
+      close_and_exit(0);
+   sauna_diff(meter, job->first, sample, job->delta);
+   job->duration = job->delta->time*1e-9;
+   job->energy = 0;
+   for(i=0; i<job->nchannels; i++) {
+      c = job->channels[i];
+      if(channels[c].whole)
+         job->energy += job->delta->channel[c] - idle[c]*job->duration;
+   }
+}
+
+/* Parses a comma separated list of numbers lower than limit. Returns the
+ * number of elements in the list or -1 on error. */
+int parse_list(const char *spec, int *list, int max, int limit, const char *what) {
+   const char *it = spec;
+   char *end;
+   int n, count = 0;
+
+   while(*it) {
+      n = strtol(it, &end, 10);
+      if(end == it || n < 0 || n >= limit) {
+         fprintf(stderr,"Specified a %s that does not exisit.\n", what);
+         return -1;
       }
-      else {
-         close_and_exit(0);
+      if(count == max) {
+         fprintf(stderr,"Specified too many %ss.\n", what);
+         return -1;
       }
+      list[count++] = n;
+      while (*end == ',') { end++; }
+      it = end;
    }
-   nvml_energy[device] += (double)power_usage/1000*delta*1e-6;
-   fprintf(out,"%f ",(double)power_usage/1000);
+   return count;
 }
 
-void query_nvml_device_energy(int device) {
-   fprintf(out,"%f ",nvml_energy[device]);
-}
+/* Builds the list of cores of a job and adds them to query_cores,
+ * unless another job already measures them. */
+int parse_job_cores(struct job *job, int nprocs) {
+   int list[MAX_CORES];
+   int i,k,n;
 
-#endif
- 
-#if XEONPHI
-void reset_mic() {
-   mic_energy = 0;
-}
-void query_mic_device_power(long long delta) {
-   struct mic_power_util_info *pinfo;
-   uint32_t power_usage;
-
-   /* Power utilization examples */
-   if (mic_get_power_utilization_info(mdh, &pinfo) != E_MIC_SUCCESS) {
-      print_mic_error("Failed to get power utilization information",
-            mic_get_device_name(mdh));
-      close_and_exit(0);
+   if(job->core_spec == NULL || *job->core_spec == '\0') {
+      for(n=0; n<nprocs; n++)
+         list[n] = n;
    }
+   else if((n = parse_list(job->core_spec,list,MAX_CORES,nprocs,"core")) < 0)
+      return -1;
 
-   if (mic_get_inst_power_readings(pinfo, &power_usage) != E_MIC_SUCCESS) {
-      print_mic_error("Failed to get instant power readings",
-            mic_get_device_name(mdh));
-      (void)mic_free_power_utilization_info(pinfo);
-      close_and_exit(0);
+   job->ncores = 0;
+   for(i=0; i<n; i++) {
+      for(k=0; k<core_count && query_cores[k]!=list[i]; k++);
+      if(k == core_count)
+         query_cores[core_count++] = list[i];
+      job->cores[job->ncores++] = k;
    }
-   mic_energy += (double)power_usage/1000000*delta*1e-6;
-   fprintf(out,"%f ",(double)power_usage/1000000);
+   return 0;
+}
 
-   (void)mic_free_power_utilization_info(pinfo);
+/* Begins the measurements of a job. The sampler runs while any job is
+ * being measured. */
+void start_job(struct job *job) {
+   sigset_t set, old;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGALRM);
+   sigprocmask(SIG_BLOCK, &set, &old);
+   if(sauna_snapshot(meter, job->first) < 0)
+      close_and_exit(0);
+   sauna_snapshot_copy(meter, job->last, job->first);
+   gettimeofday(&job->last_time,NULL);
+   job->state = JOB_MEASURING;
+   /* The collector needs the absolute time the measurements refer to */
+   if(flag_stream) {
+      print_job_prefix(job);
+      fprintf(out,"Start: %ld.%06ld\n",(long)job->last_time.tv_sec,(long)job->last_time.tv_usec);
+   }
+   if(active_jobs++ == 0)
+      ualarm(interval, interval);
+   sigprocmask(SIG_SETMASK, &old, NULL);
 }
 
-void query_mic_device_energy() {
-   fprintf(out,"%f ",mic_energy);
+void stop_job(struct job *job) {
+   sigset_t set, old;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGALRM);
+   sigprocmask(SIG_BLOCK, &set, &old);
+   job->state = JOB_WAITING;
+   if(--active_jobs == 0)
+      ualarm(0, interval);
+   job_totals(job);
+   if(flag_total != 0) print_total_energy(job);
+   sigprocmask(SIG_SETMASK, &old, NULL);
 }
 
-int init_mic()
-{
-   int ncards, card_num, card;
-   struct mic_devices_list *mdl;
-   int ret;
-   uint32_t device_type;
-
-   ret = mic_get_devices(&mdl);
-   if (ret == E_MIC_DRIVER_NOT_LOADED) {
-      fprintf(stderr, "Error: The driver is not loaded! ");
-      fprintf(stderr, "Load the driver before using this tool.\n");
-      return 1;
-   } else if (ret == E_MIC_ACCESS) {
-      fprintf(stderr, "Error: Access is denied to the driver! ");
-      fprintf(stderr, "Do you have permissions to access the driver?\n");
-      return 1;
-   } else if (ret != E_MIC_SUCCESS) {
-      fprintf(stderr, "Failed to get cards list: %s: %s\n",
-            mic_get_error_string(), strerror(errno));
+/* Reads the data available in fd and passes every complete line, including
+ * its newline, to handle. Returns 0 at the end of file, after passing any
+ * unterminated last line. */
+int read_lines(int fd, struct line_buf *buf, void (*handle)(char *line, void *arg), void *arg) {
+   ssize_t n;
+   char *line, *nl, c;
+
+   if(buf->size - buf->len < BUFSIZ) {
+      buf->size += BUFSIZ;
+      if((buf->line = realloc(buf->line, buf->size)) == NULL) {
+         fprintf(stderr,"Error: out of memory reading lines.\n");
+         close_and_exit(EXIT_FAILURE);
+      }
+   }
+   n = read(fd, buf->line + buf->len, buf->size - buf->len - 1);
+   if(n < 0 && errno == EINTR)
       return 1;
+   if(n <= 0) {
+      if(buf->len > 0) {
+         buf->line[buf->len] = '\0';
+         buf->len = 0;
+         handle(buf->line, arg);
+      }
+      return 0;
    }
-
-   if (mic_get_ndevices(mdl, &ncards) != E_MIC_SUCCESS) {
-      print_mic_error("Failed to get number of cards", NULL);
-      (void)mic_free_devices(mdl);
-      return 2;
+   buf->len += n;
+   buf->line[buf->len] = '\0';
+
+   for(line = buf->line; (nl = strchr(line, '\n')) != NULL; line = nl+1) {
+      c = nl[1];
+      nl[1] = '\0';
+      handle(line, arg);
+      nl[1] = c;
    }
+   buf->len -= line - buf->line;
+   memmove(buf->line, line, buf->len);
+   return 1;
+}
 
-   if (ncards == 0) {
-      print_mic_error("No MIC card found", NULL);
-      (void)mic_free_devices(mdl);
-      return 3;
-   }
+/* Looks for the ROI marks in the output of a job and forwards it to stdout */
+void handle_job_line(char *line, void *arg) {
+   struct job *job = arg;
+
+   /* If ROI analysis is set, and begining of ROI is detected start measurements */
+   if(flag_roi && job->state != JOB_MEASURING && strstr(line, "++ROI"))
+      start_job(job);
+   /* Stop measurements at the end of the ROI */
+   else if(flag_roi && job->state == JOB_MEASURING && strstr(line, "--ROI"))
+      stop_job(job);
+   fputs(line, stdout);
+}
+
+/* Adds a dimension to the sweep with a comma separated list of values */
+int add_sweep_dim(int type, char *name, char *values) {
+   struct sweep_dim *dim;
+   char *value;
 
-   /* Get card at index 0 */
-   card_num = 0;
-   if (mic_get_device_at_index(mdl, card_num, &card) != E_MIC_SUCCESS) {
-      fprintf(stderr, "Error: Failed to get card at index %d: %s: %s\n",
-            card_num, mic_get_error_string(), strerror(errno));
-      mic_free_devices(mdl);
-      return 4;
+   if(values == NULL || *values == '\0') {
+      fprintf(stderr,"Missing values to sweep %s.\n", name);
+      return -1;
+   }
+   if(sweep_count == MAX_SWEEP) {
+      fprintf(stderr,"Too many sweep dimensions. Increase MAX_SWEEP and recompile.\n");
+      return -1;
    }
+   dim = &sweep[sweep_count++];
+   dim->type = type;
+   dim->name = name;
+   for(value = strtok(values,","); value != NULL; value = strtok(NULL,",")) {
+      if(dim->count == MAX_SWEEP_VALUES) {
+         fprintf(stderr,"Too many values to sweep %s. Increase MAX_SWEEP_VALUES and recompile.\n", name);
+         return -1;
+      }
+      dim->values[dim->count++] = value;
+   }
+   return 0;
+}
 
-   (void)mic_free_devices(mdl);
+int read_cpu_setting(int cpu, const char *setting, char *value, size_t size) {
+   char filename[BUFSIZ];
+   FILE *fff;
 
-   if (mic_open_device(&mdh, card) != E_MIC_SUCCESS) {
-      fprintf(stderr, "Error: Failed to open card %d: %s: %s\n",
-            card_num, mic_get_error_string(), strerror(errno));
-      return 5;
+   sprintf(filename,"/sys/devices/system/cpu/cpu%d/%s",cpu,setting);
+   if((fff = fopen(filename,"r")) == NULL)
+      return -1;
+   if(fgets(value, size, fff) == NULL) {
+      fclose(fff);
+      return -1;
    }
+   value[strcspn(value,"\n")] = '\0';
+   fclose(fff);
+   return 0;
+}
 
-   if (mic_get_device_type(mdh, &device_type) != E_MIC_SUCCESS) {
-      print_mic_error("Failed to get device type", mic_get_device_name(mdh));
-      (void)mic_close_device(mdh);
-      return 6;
-   }
+int write_cpu_setting(int cpu, const char *setting, const char *value) {
+   char filename[BUFSIZ];
+   FILE *fff;
 
-   if (device_type != KNC_ID) {
-      fprintf(stderr, "Error: Unknown device Type: %u\n", device_type);
-      (void)mic_close_device(mdh);
-      return 7;
+   sprintf(filename,"/sys/devices/system/cpu/cpu%d/%s",cpu,setting);
+   if((fff = fopen(filename,"w")) == NULL || fprintf(fff,"%s",value) < 0 || fclose(fff) != 0) {
+      fprintf(stderr,"Error: Could not write %s. %s\n", filename, strerror(errno));
+      return -1;
    }
-   //printf("    Found KNC device '%s'\n", mic_get_device_name(mdh));
-   mic_energy = 0;
-   mic_up = 0;
    return 0;
 }
 
-int close_mic()
-{
+/* Reads the package of every cpu, 0 if the topology is not known */
+void read_packages(int nprocs) {
+   char value[32];
+   int cpu;
 
-    (void)mic_close_device(mdh);
-    return 0;
+   for(cpu = 0; cpu < nprocs; cpu++) {
+      package_of[cpu] = 0;
+      if(read_cpu_setting(cpu,"topology/physical_package_id",value,sizeof(value)) == 0)
+         package_of[cpu] = atoi(value);
+   }
 }
 
-void print_mic_error(const char *msg, const char *device_name)
-{
-    const char *mic_err_str = mic_get_error_string();
-
-    fprintf(stderr, "Error");
-    if (device_name != NULL)
-        fprintf(stderr, ": %s", device_name);
-    fprintf(stderr, ": %s", msg);
-    if (strcmp("No error registered", mic_err_str) != 0)
-        fprintf(stderr, ": %s", mic_err_str);
-    if (errno == 0)
-        fprintf(stderr, "\n");
-    else
-        fprintf(stderr, ": %s\n", strerror(errno));
+/* RAPL measures whole packages, so the energy of a package shared by
+ * several jobs would be accounted to all of them */
+int check_job_packages() {
+   int j,k,jj,kk;
+
+   for(j = 1; j < job_count; j++)
+      for(k = 0; k < jobs[j].ncores; k++)
+         for(jj = 0; jj < j; jj++)
+            for(kk = 0; kk < jobs[jj].ncores; kk++)
+               if(package_of[query_cores[jobs[j].cores[k]]] == package_of[query_cores[jobs[jj].cores[kk]]]) {
+                  fprintf(stderr,"Commands %d and %d share package %d. Give them cores of different packages with -c.\n",
+                        jj, j, package_of[query_cores[jobs[j].cores[k]]]);
+                  return -1;
+               }
+   return 0;
 }
-#endif
 
-void close_and_exit(int code) {
-#if NVIDIA
-   nvmlReturn_t result;
-   if(nvml_up) {
-      if ((result = nvmlShutdown()) != NVML_SUCCESS) {
-         fprintf(stderr,"Failed to shutdown NVML: %s\n", nvmlErrorString(result));
+/* Finds the cpus in the packages of the measured cores, whose cpufreq
+ * settings are changed by the sweep, and saves their current settings. */
+int init_sweep() {
+   int i,k,cpu,nprocs = get_nprocs();
+   int freq = 0;
+
+   if(job_count > 1) {
+      fprintf(stderr,"A sweep measures a single command.\n");
+      return -1;
+   }
+   for(i = 0; i < sweep_count; i++)
+      if(sweep[i].type == SWEEP_FREQ) freq = 1;
+   /* The idle power is only calibrated at the original settings */
+   for(i = 0; i < sweep_count && baseline_window > 0; i++) {
+      if(sweep[i].type != SWEEP_ENV || sweep_governor != NULL) {
+         fprintf(stderr,"The idle baseline can not be subtracted when sweeping frequencies, clocks or governors.\n");
+         return -1;
       }
    }
-#endif
-   if(rapl_up)
-      close_rapl_perf();
-#if XEONPHI
-   if(mic_up)
-      close_mic();
-#endif
-   exit(code);
-}
 
-void alarm_handler (int signo)
-{
-   int i;
-   struct timeval time;
-   double now;
-   static double before = 0;
+   /* Restore the settings if sauna is interrupted */
+   signal(SIGINT, terminate_handler);
+   signal(SIGTERM, terminate_handler);
+   signal(SIGHUP, terminate_handler);
+   if(!freq && sweep_governor == NULL) {
+      sweep_up = 1;
+      return 0;
+   }
 
-   gettimeofday(&time,NULL);
+   for(cpu = 0; cpu < nprocs; cpu++) {
+      for(k = 0; k < core_count && package_of[cpu] != package_of[query_cores[k]]; k++);
+      if(k == core_count) continue;
+      if(read_cpu_setting(cpu,"cpufreq/scaling_max_freq",saved_max_freq[cpu],sizeof(saved_max_freq[cpu])) < 0 ||
+         read_cpu_setting(cpu,"cpufreq/scaling_governor",saved_governor[cpu],sizeof(saved_governor[cpu])) < 0) {
+         fprintf(stderr,"Error: cpufreq is not available for cpu %d.\n", cpu);
+         return -1;
+      }
+      sweep_cpus[sweep_cpu_count++] = cpu;
+   }
+   sweep_up = 1;
 
-   now = (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6;
-   if(before == 0) before = now-interval;
-   fprintf(out,"%f ",(double) now);
-   for(i=0; i<core_count; i++)
-      query_rapl_device_power(i,(now-before)*1e6);
+   if(sweep_governor != NULL) {
+      for(i = 0; i < sweep_cpu_count; i++)
+         if(write_cpu_setting(sweep_cpus[i],"cpufreq/scaling_governor",sweep_governor) < 0)
+            return -1;
+   }
+   return 0;
+}
+
+void apply_sweep_setting(struct sweep_dim *dim, char *value) {
+   int i;
 #if NVIDIA
-   for(i=0; i<device_count; i++)
-      query_nvml_device_power(i,interval);
+   nvmlReturn_t result;
+   nvmlDevice_t device;
+   unsigned int mem, gfx;
 #endif
-#if XEONPHI
-   query_mic_device_power(interval);
+
+   switch(dim->type) {
+      case SWEEP_ENV:
+         setenv(dim->name, value, 1);
+         break;
+      case SWEEP_FREQ:
+         /* The userspace governor needs the speed itself */
+         for(i = 0; i < sweep_cpu_count; i++) {
+            if(write_cpu_setting(sweep_cpus[i],"cpufreq/scaling_max_freq",value) < 0)
+               close_and_exit(EXIT_FAILURE);
+            if(sweep_governor != NULL && strcmp(sweep_governor,"userspace") == 0 &&
+               write_cpu_setting(sweep_cpus[i],"cpufreq/scaling_setspeed",value) < 0)
+               close_and_exit(EXIT_FAILURE);
+         }
+         break;
+      case SWEEP_CLOCKS:
+#if NVIDIA
+         if(sscanf(value,"%u:%u",&mem,&gfx) != 2) {
+            fprintf(stderr,"Invalid clocks %s - expecting <memory>:<graphics> in MHz.\n", value);
+            close_and_exit(EXIT_FAILURE);
+         }
+         /* NVML is kept initialized by the meter */
+         for(i = 0; i < jobs[0].ngpus; i++) {
+            if ((result = nvmlDeviceGetHandleByIndex(jobs[0].gpus[i], &device)) != NVML_SUCCESS ||
+                (result = nvmlDeviceSetApplicationsClocks(device, mem, gfx)) != NVML_SUCCESS) {
+               fprintf(stderr,"Error: Failed to set clocks of device %d: %s\n", jobs[0].gpus[i], nvmlErrorString(result));
+               close_and_exit(EXIT_FAILURE);
+            }
+         }
+#else
+         fprintf(stderr,"Error: GPU clocks can not be swept without NVIDIA support.\n");
+         close_and_exit(EXIT_FAILURE);
 #endif
-   fprintf(out,"\n");
-   before = now;
+         break;
+   }
 }
 
-void print_total_energy() {
-   int i;
-   struct timeval time;
-
-   fprintf(out,"Totals: ");
-   gettimeofday(&time,NULL);
+/* Leaves cpufreq and application clocks as they were before the sweep */
+void terminate_handler(int signo) {
+   close_and_exit(128+signo);
+}
 
-   fprintf(out,"%f ",(double) (time.tv_sec-last_time.tv_sec)+(time.tv_usec-last_time.tv_usec)*1e-6);
-   for(i=0; i<core_count; i++)
-      query_rapl_device_energy(i);
+void restore_sweep() {
+   int i;
 #if NVIDIA
-   for(i=0; i<device_count; i++)
-      query_nvml_device_energy(i);
+   int k;
+   nvmlDevice_t device;
 #endif
-#if XEONPHI
-   query_mic_device_energy();
+
+   sweep_up = 0;
+   for(i = 0; i < sweep_cpu_count; i++) {
+      write_cpu_setting(sweep_cpus[i],"cpufreq/scaling_governor",saved_governor[sweep_cpus[i]]);
+      write_cpu_setting(sweep_cpus[i],"cpufreq/scaling_max_freq",saved_max_freq[sweep_cpus[i]]);
+   }
+#if NVIDIA
+   for(i = 0; i < sweep_count; i++) {
+      if(sweep[i].type == SWEEP_CLOCKS) {
+         for(k = 0; k < jobs[0].ngpus; k++)
+            if(nvmlDeviceGetHandleByIndex(jobs[0].gpus[k], &device) == NVML_SUCCESS)
+               nvmlDeviceResetApplicationsClocks(device);
+         break;
+      }
+   }
 #endif
-   fprintf(out,"\n");
 }
 
-int perf_event_open(struct perf_event_attr *hw_event_uptr,
-                    pid_t pid, int cpu, int group_fd, unsigned long flags) {
+void print_sweep_point(const char *tag, struct sweep_point *point) {
+   int i;
 
-        return syscall(__NR_perf_event_open,hw_event_uptr, pid, cpu,
-                        group_fd, flags);
+   fprintf(out,"%s",tag);
+   for(i = 0; i < sweep_count; i++)
+      fprintf(out," %s",sweep[i].values[point->index[i]]);
+   fprintf(out," %f %f\n",point->time,point->energy);
 }
 
-int init_rapl_perf() {
+/* Checks if point a is not worse than b in time, and better in energy by
+ * more than the given fraction of the energy of b. Energies can be
+ * negative once the idle baseline is subtracted. With no margin, a must
+ * just be better in time or energy. */
+int dominates(struct sweep_point *a, struct sweep_point *b, double margin) {
+   if(a->time > b->time) return 0;
+   if(margin > 0)
+      return (fabs(a->energy) > SWEEP_MIN_ENERGY || fabs(b->energy) > SWEEP_MIN_ENERGY) &&
+             a->energy < b->energy - margin*fabs(b->energy);
+   if(a->energy > b->energy) return 0;
+   return a->time < b->time || a->energy < b->energy;
+}
 
-   FILE *fff;
-   int type;
-   int config=0;
-   char filename[BUFSIZ];
-   char units[BUFSIZ];
-   struct perf_event_attr attr;
-   int i,j;
+/* Measures the command over the grid of settings, varying the last swept
+ * dimension first. Along it, once a point is clearly dominated by the
+ * previous one, the rest of its values are assumed to be worse and are
+ * skipped. Every point measured is reported, followed by the Pareto
+ * frontier of time and energy. */
+void run_sweep() {
+   struct sweep_point *points = NULL, *point;
+   int index[MAX_SWEEP] = { 0 };
+   int npoints = 0, size = 0;
+   int i,k,last;
+
+   fprintf(out,"Sweep:");
+   for(i = 0; i < sweep_count; i++)
+      fprintf(out," %s",sweep[i].name);
+   fprintf(out," time energy\n");
+
+   last = sweep_count-1;
+   while(index[0] < sweep[0].count) {
+      if(npoints == size) {
+         size += 64;
+         if((points = realloc(points, size*sizeof(*points))) == NULL) {
+            fprintf(stderr,"Error: out of memory in sweep.\n");
+            close_and_exit(EXIT_FAILURE);
+         }
+      }
+      point = &points[npoints++];
+      for(i = 0; i < sweep_count; i++) {
+         point->index[i] = index[i];
+         apply_sweep_setting(&sweep[i], sweep[i].values[index[i]]);
+      }
+      run_jobs();
+      point->time = jobs[0].duration;
+      point->energy = jobs[0].energy;
+      print_sweep_point("Point:", point);
+
+      /* Move to the next point, skipping the rest of the last dimension
+       * when it stops paying off */
+      if(index[last] > 0 && dominates(point-1, point, SWEEP_MARGIN))
+         index[last] = sweep[last].count-1;
+      for(i = last; i >= 0; i--) {
+         if(++index[i] < sweep[i].count || i == 0) break;
+         index[i] = 0;
+      }
+   }
 
-   fff=fopen("/sys/bus/event_source/devices/power/type","r");
-   if (fff==NULL) {
-      fprintf(stderr,"No perf_event rapl support found (requires Linux 3.14)\n");
-      return -1;
+   for(k = 0; k < npoints; k++) {
+      for(i = 0; i < npoints && !dominates(&points[i], &points[k], 0); i++);
+      if(i == npoints)
+         print_sweep_point("Pareto:", &points[k]);
    }
-   fscanf(fff,"%d",&type);
-   fclose(fff);
+   free(points);
+}
 
-   for(i=0; i<core_count; i++) {
-      for(j=0;j<NUM_RAPL_DOMAINS;j++) {
+double now_seconds() {
+   struct timeval time;
 
-#ifdef VERBOSE
-         fprintf(stderr,"Trying core %d with RAPL domain %s (%d)\n",query_cores[i],rapl_domain_names[j],j);
-#endif
-         fd[i][j]=-1;
+   gettimeofday(&time,NULL);
+   return time.tv_sec+time.tv_usec*1e-6;
+}
 
-         sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s",
-               rapl_domain_names[j]);
+/* Reads a single line from fd without buffering beyond its newline, which
+ * is removed. Returns -1 at the end of file. */
+int read_line(int fd, char *line, size_t size) {
+   size_t len = 0;
+   ssize_t n;
+   char c;
 
-         fff=fopen(filename,"r");
+   while((n = read(fd, &c, 1)) != 0) {
+      if(n < 0) {
+         if(errno == EINTR) continue;
+         return -1;
+      }
+      if(c == '\n') break;
+      if(len < size-1) line[len++] = c;
+   }
+   line[len] = '\0';
+   return n == 0 ? -1 : len;
+}
 
-         if (fff!=NULL) {
-            fscanf(fff,"event=%x",&config);
-#ifdef VERBOSE
-            fprintf(stderr,"Found config=%d\n",config);
-#endif
-            fclose(fff);
-         } else {
-            continue;
-         }
+/* Connects to the collector and answers its clock offset handshake. The
+ * output is then sent through the connection. */
+int connect_collector(char *address) {
+   struct addrinfo hints, *res, *it;
+   char *port = strrchr(address,':');
+   char line[BUFSIZ], hostname[64];
+   double t1;
+   int sock = -1;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   *port = '\0';
+   if(getaddrinfo(address, port+1, &hints, &res) != 0) {
+      fprintf(stderr,"Error: Could not resolve collector %s.\n", address);
+      *port = ':';
+      return -1;
+   }
+   *port = ':';
+   for(it = res; it != NULL; it = it->ai_next) {
+      if((sock = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC, it->ai_protocol)) < 0)
+         continue;
+      if(connect(sock, it->ai_addr, it->ai_addrlen) == 0)
+         break;
+      close(sock);
+      sock = -1;
+   }
+   freeaddrinfo(res);
+   if(sock < 0) {
+      fprintf(stderr,"Error: Could not connect to collector. %s\n", strerror(errno));
+      return -1;
+   }
 
-         sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s.scale",
-               rapl_domain_names[j]);
-         fff=fopen(filename,"r");
+   gethostname(hostname, sizeof(hostname));
+   hostname[sizeof(hostname)-1] = '\0';
+   dprintf(sock,"Hello: %s %d\n", hostname, job_count);
+   /* Answer each ping with the local time, until the collector is done */
+   while(read_line(sock, line, sizeof(line)) >= 0) {
+      if(sscanf(line,"Ping: %lf",&t1) == 1)
+         dprintf(sock,"Pong: %.6f %.6f\n", t1, now_seconds());
+      else if(strcmp(line,"Go") == 0)
+         break;
+   }
+   if(strcmp(line,"Go") != 0) {
+      fprintf(stderr,"Error: Collector closed the connection.\n");
+      close(sock);
+      return -1;
+   }
 
-         if (fff!=NULL) {
-            fscanf(fff,"%lf",&scale[j]);
-#ifdef VERBOSE
-            fprintf(stderr,"Found scale=%g\n",scale[j]);
-#endif
-            fclose(fff);
-         }
+   if(out != stderr) fclose(out);
+   if((out = fdopen(sock,"w")) == NULL) {
+      close(sock);
+      return -1;
+   }
+   setvbuf(out, NULL, _IOLBF, 0);
+   flag_stream = 1;
+   flag_total = 1;
+   return 0;
+}
 
-         sprintf(filename,"/sys/bus/event_source/devices/power/events/energy-%s.unit",
-               rapl_domain_names[j]);
-         fff=fopen(filename,"r");
+/* Waits for all the nodes to connect, estimates their clock offsets and
+ * merges their output until they all finish. */
+int run_collector(int port) {
+   struct sockaddr_in addr;
+   struct pollfd fds[MAX_NODES];
+   struct node *node;
+   char line[BUFSIZ];
+   double t1, t2, t3, start;
+   int sock, one = 1;
+   int i, k, running;
+
+   if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      fprintf(stderr,"Error: Could not create socket. %s\n", strerror(errno));
+      return -1;
+   }
+   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   addr.sin_port = htons(port);
+   if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, MAX_NODES) < 0) {
+      fprintf(stderr,"Error: Could not listen on port %d. %s\n", port, strerror(errno));
+      close(sock);
+      return -1;
+   }
 
-         if (fff!=NULL) {
-            fscanf(fff,"%s",units);
-#ifdef VERBOSE
-            fprintf(stderr,"Found units=%s\n",units);
-#endif
-            fclose(fff);
+   for(i = 0; i < node_count; i++) {
+      node = &nodes[i];
+      if((node->fd = accept(sock, NULL, NULL)) < 0) {
+         if(errno == EINTR) { i--; continue; }
+         fprintf(stderr,"Error: Failed to accept node. %s\n", strerror(errno));
+         return -1;
+      }
+      if(read_line(node->fd, line, sizeof(line)) < 0 || sscanf(line,"Hello: %63s",node->host) != 1) {
+         fprintf(stderr,"Error: Node %d did not introduce itself.\n", i);
+         return -1;
+      }
+      /* The offset is taken from the exchange with the shortest round
+       * trip, assuming it was symmetric */
+      node->rtt = -1;
+      for(k = 0; k < SYNC_ROUNDS; k++) {
+         t1 = now_seconds();
+         dprintf(node->fd,"Ping: %.6f\n", t1);
+         if(read_line(node->fd, line, sizeof(line)) < 0 || sscanf(line,"Pong: %lf %lf",&t1,&t2) != 2) {
+            fprintf(stderr,"Error: Node %d failed the clock handshake.\n", i);
+            return -1;
          }
+         t3 = now_seconds();
+         if(node->rtt < 0 || t3-t1 < node->rtt) {
+            node->rtt = t3-t1;
+            node->offset = t2-(t1+t3)/2;
+         }
+      }
+      fprintf(out,"%d Node: %s %f %f\n", i, node->host, node->offset, node->rtt);
+   }
+   close(sock);
+
+   /* All the nodes start together, at the beginning of the merged trace */
+   start = now_seconds();
+   for(i = 0; i < node_count; i++) {
+      nodes[i].offset += start;
+      dprintf(nodes[i].fd,"Go\n");
+      fds[i].fd = nodes[i].fd;
+      fds[i].events = POLLIN;
+   }
 
-         attr.type=type;
-         attr.config=config;
-
-         fd[i][j]=perf_event_open(&attr,-1,query_cores[i],-1,PERF_FLAG_FD_CLOEXEC);
-         if (fd[i][j]<0) {
-            if (errno==EACCES) {
-               fprintf(stderr,"Permission denied; run as root or adjust paranoid value\n");
-               return -1;
-            }
-            else {
-               fprintf(stderr,"error opening perf events: %s\n",strerror(errno));
-               return -1;
-            }
+   running = node_count;
+   while (running > 0) {
+      if(poll(fds, node_count, -1) < 0) {
+         if(errno == EINTR) continue;
+         fprintf(stderr,"Error: failed to wait for nodes. %s\n", strerror(errno));
+         break;
+      }
+      for(i = 0; i < node_count; i++) {
+         if(fds[i].fd < 0 || fds[i].revents == 0) continue;
+         if(read_lines(fds[i].fd,&nodes[i].input,handle_node_line,&nodes[i]) == 0) {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            running--;
          }
-         first_value[i][j] = 0;
-         last_value[i][j] = 0;
       }
    }
-   rapl_up = 1;
+
+   fprintf(out,"Totals: %f %f\n", last_end-first_start, total_energy);
+   for(i = 0; i < node_count; i++) {
+      free(nodes[i].input.line);
+      for(k = 0; k < MAX_JOBS; k++)
+         free(nodes[i].sum_mask[k]);
+   }
    return 0;
 }
 
-void reset_rapl_perf() {
-   int i,core;
-
-   for(core=0; core<core_count; core++) {
-      for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-         if (fd[core][i]!=-1) {
-            read(fd[core][i],&last_value[core][i],8);
-            first_value[core][i] = last_value[core][i];
-         }
+/* Merges a line of a node in the trace with its time aligned to the
+ * collector. Only the whole channels flagged by the node in its "Whole:"
+ * line add up to the total energy. */
+void handle_node_line(char *line, void *arg) {
+   struct node *node = arg;
+   int n = node - nodes;
+   char *rest, *end, *tok;
+   double t;
+   int job, k;
+
+   job = strtol(line, &rest, 10);
+   if(rest == line || job < 0 || job >= MAX_JOBS) return;
+   while(*rest == ' ') rest++;
+
+   if(strncmp(rest,"time",4) == 0) {
+      fprintf(out,"%d %d %s", n, job, rest);
+   }
+   else if(strncmp(rest,"Whole:",6) == 0) {
+      free(node->sum_mask[job]);
+      node->sum_count[job] = 0;
+      if((node->sum_mask[job] = calloc(strlen(rest), 1)) == NULL) {
+         fprintf(stderr,"Error: out of memory merging node %s.\n", node->host);
+         return;
+      }
+      for(k = 0, tok = rest+6; ; k++) {
+         node->sum_mask[job][k] = strtol(tok, &end, 10);
+         if(end == tok) break;
+         tok = end;
       }
+      node->sum_count[job] = k;
+   }
+   else if(strncmp(rest,"Start:",6) == 0) {
+      node->start[job] = strtod(rest+6, NULL) - node->offset;
+      if(first_start < 0 || node->start[job] < first_start)
+         first_start = node->start[job];
+   }
+   else if(strncmp(rest,"Totals:",7) == 0) {
+      t = strtod(rest+7, &end);
+      if(node->start[job]+t > last_end)
+         last_end = node->start[job]+t;
+      fprintf(out,"%d %d Totals: %f%s", n, job, t, end);
+      for(k = 0, tok = end; k < node->sum_count[job]; k++) {
+         t = strtod(tok, &end);
+         if(end == tok) break;
+         if(node->sum_mask[job][k]) total_energy += t;
+         tok = end;
+      }
+   }
+   else {
+      t = strtod(rest, &end);
+      if(end == rest) return;
+      fprintf(out,"%d %d %f%s", n, job, node->start[job]+t, end);
    }
 }
 
-void query_rapl_device_power(int core,long long delta) {
+/* Builds the key that identifies this configuration in the cache, made of
+ * the host, the calibration window, the sampling interval, which changes
+ * how the power of devices is integrated, and the names of the channels. */
+void baseline_key(char *key, size_t size) {
    int i;
-   long long value;
-   for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-      if (fd[core][i]!=-1) {
-         read(fd[core][i],&value,8);
-         fprintf(out,"%lf ",(double)(value-last_value[core][i])*scale[i]/delta/1e-6);
-         last_value[core][i] = value;
+   size_t len;
+
+   gethostname(key, size);
+   key[size-1] = '\0';
+   len = strlen(key);
+   len += snprintf(key+len, size-len, " %ld %ld ", baseline_window, (long)interval);
+   for(i=0; i<channel_count && len < size; i++)
+      len += snprintf(key+len, size-len, "%s,", channels[i].name);
+}
+
+/* Finds the cache of baselines of the user. Only root can write the
+ * system one, so other users keep their own. Returns -1 if there is no
+ * place for it. */
+int baseline_path() {
+   const char *base;
+
+   if(geteuid() == 0)
+      snprintf(baseline_dir, sizeof(baseline_dir), "%s", BASELINE_DIR);
+   else if((base = getenv("XDG_CACHE_HOME")) != NULL && *base)
+      snprintf(baseline_dir, sizeof(baseline_dir), "%s/sauna", base);
+   else if((base = getenv("HOME")) != NULL && *base)
+      snprintf(baseline_dir, sizeof(baseline_dir), "%s/.cache/sauna", base);
+   else
+      return -1;
+   snprintf(baseline_cache, sizeof(baseline_cache), "%s/baseline", baseline_dir);
+   return 0;
+}
+
+/* Opens the cache of baselines without following links. It must belong to
+ * the effective user and not be writable by others, as anyone able to
+ * change it could fake the idle power subtracted from the measurements. */
+FILE *open_baseline_cache(int flags) {
+   struct stat st;
+   char *it;
+   int fd;
+
+   if(baseline_cache[0] == '\0' && baseline_path() < 0) {
+      errno = ENOENT;
+      return NULL;
+   }
+   if(flags & O_CREAT) {
+      /* Create the missing parents too, such as ~/.cache */
+      for(it = strchr(baseline_dir+1,'/'); it != NULL; it = strchr(it+1,'/')) {
+         *it = '\0';
+         mkdir(baseline_dir, 0700);
+         *it = '/';
       }
+      mkdir(baseline_dir, geteuid() == 0 ? 0755 : 0700);
    }
+   if((fd = open(baseline_cache, flags | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0)
+      return NULL;
+   if(fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+      fprintf(stderr,"Warning: Ignoring %s, which belongs to another user or is writable by others.\n", baseline_cache);
+      close(fd);
+      errno = EPERM;
+      return NULL;
+   }
+   return fdopen(fd, (flags & O_APPEND) ? "a" : "r");
 }
 
-void query_rapl_device_energy(int core) {
-   int i;
-   long long value;
-   for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-      if (fd[core][i]!=-1) {
-         read(fd[core][i],&value,8);
-         fprintf(out,"%lf ",(double)(value-first_value[core][i])*scale[i]);
+/* Looks for the baseline of this configuration in the cache, taking the
+ * last one calibrated. Returns -1 if it has never been calibrated. */
+int load_baseline() {
+   char key[BUFSIZ];
+   char *line = NULL, *it, *end;
+   size_t len = 0, key_len;
+   int i, found = -1;
+   double *value;
+   FILE *cache;
+
+   if((cache = open_baseline_cache(O_RDONLY)) == NULL)
+      return -1;
+   if((value = malloc((channel_count+1)*sizeof(double))) == NULL) {
+      fclose(cache);
+      return -1;
+   }
+   baseline_key(key, sizeof(key));
+   key_len = strlen(key);
+   while(getline(&line, &len, cache) != -1) {
+      if(strncmp(line, key, key_len) != 0 || line[key_len] != ' ') continue;
+      for(i = 0, it = line+key_len; i < channel_count; i++, it = end) {
+         value[i] = strtod(it, &end);
+         if(end == it) break;
+      }
+      if(i == channel_count) {
+         memcpy(idle, value, channel_count*sizeof(double));
+         found = 0;
       }
    }
+   free(value);
+   free(line);
+   fclose(cache);
+   return found;
 }
 
-void close_rapl_perf() {
-   int core,i;
-   for(core=0; core<core_count; core++) {
-      for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-         if (fd[core][i]!=-1) {
-            close(fd[core][i]);
-         }
-      }
+void save_baseline() {
+   char key[BUFSIZ];
+   int i;
+   FILE *cache;
+
+   if((cache = open_baseline_cache(O_WRONLY | O_APPEND | O_CREAT)) == NULL) {
+      fprintf(stderr,"Warning: Could not save baseline in %s. %s\n", baseline_cache, strerror(errno));
+      return;
    }
-   rapl_up = 0;
+   baseline_key(key, sizeof(key));
+   fprintf(cache,"%s",key);
+   for(i = 0; i < channel_count; i++)
+      fprintf(cache," %f",idle[i]);
+   fprintf(cache,"\n");
+   fclose(cache);
 }
 
+/* Measures the idle power of every channel over the calibration window.
+ * Samples are taken at the usual interval so that the power of devices
+ * is integrated as during the measurements. */
+void calibrate_baseline() {
+   struct sauna_snapshot *first;
+   struct sauna_energy *energy;
+   int i;
+
+   if((first = sauna_snapshot_new(meter)) == NULL || (energy = sauna_energy_new(meter)) == NULL ||
+      sauna_snapshot(meter, first) < 0)
+      close_and_exit(0);
+   do {
+      usleep(interval);
+      if(sauna_snapshot(meter, sample) < 0)
+         close_and_exit(0);
+      sauna_diff(meter, first, sample, energy);
+   } while(energy->time < baseline_window*1000000);
+
+   for(i=0; i<channel_count; i++)
+      idle[i] = energy->channel[i]/(energy->time*1e-9);
+   free(first);
+   free(energy);
+}